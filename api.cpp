@@ -0,0 +1,639 @@
+#include "api.h"
+
+#include "banks.h"
+#include "glstate.h"
+#include "map.h"
+#include "pacer.h"
+#include "profiler.h"
+#include "screen.hpp"
+#include "shader.h"
+#include "sprites.h"
+#include "trace.h"
+#include "vox.h"
+
+#include <SDL.h>
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <epoxy/gl.h>
+#include <mutex>
+#include <stdio.h>
+#include <thread>
+
+#define VOX_PROFILE_OVERLAY_FRAMES 30 // Frames the overlay averages over
+#define VOX_FRAME_LISTS 3             // Being recorded, newest finished, being drawn
+#define VOX_FRAME_WAIT_MS 100         // How long frame() waits for a new list
+
+static Sprites sprites;
+static Screen screen;
+static Map tilemap;
+static BankCache bank_cache;
+static SDL_Rect screen_rect;
+static bool indexed = true; // Draw into the screen framebuffer, otherwise directly to the window
+static uint64_t rnd_state;
+static bool profile_overlay;
+// Sheet of spr(), sspr() and map(), -1 skips them. Each drawing thread has its own like the
+// draw palette.
+static thread_local int current_bank = VOX_BANK_GAME;
+// The archive bank use_bank() picked or -1. It's used again the first time the thread draws in
+// each frame of the cache, so the cache doesn't evict it while the thread still draws with it.
+static thread_local int current_archive_bank = -1;
+static thread_local uint64_t current_bank_frame;
+
+// A frame recorded by the worker, immutable once it's published. The recorder carries the
+// map changes too.
+struct FrameList {
+  SpritesRecorder recorder;
+  int screen_map[16];
+};
+
+// Triple buffering between the worker and frame(). The worker only ever owns list_writing
+// and frame() list_reading, they trade with list_ready under lists_mutex.
+static FrameList frame_lists[VOX_FRAME_LISTS];
+static unsigned int list_writing = 0;
+static unsigned int list_ready = 1;
+static unsigned int list_reading = 2;
+static bool list_fresh; // list_ready hasn't been drawn yet
+static std::mutex lists_mutex;
+static std::condition_variable lists_changed;
+static std::thread worker;
+static std::atomic<bool> worker_running;
+static bool threaded; // frame() draws the worker's lists
+static unsigned int worker_rate;
+static int worker_screen_map[16];
+static int worker_color_map[16]; // The worker's draw palette between frames
+static int worker_alpha_map[16];
+static int worker_bank;
+static int worker_archive_bank;
+static thread_local bool is_worker;
+
+// Counters summed over every dump_counters() interval
+static FILE* counters_file;
+static unsigned int counters_every;
+static unsigned int counters_frames;
+static SpritesCounters counters_sum;
+static GLStateCounters gl_counters_sum;
+
+bool init(bool indexed_screen, unsigned int sprites_flags) {
+  indexed = indexed_screen;
+  if (indexed && !screen_init(&screen)) {
+    return false;
+  }
+  if (!sprites_init(&sprites, sprites_flags | (indexed ? VOX_SPRITES_INDEXED : 0)) ||
+      !map_init(&tilemap)) {
+    return false;
+  }
+  sprites_set_map(&sprites, &tilemap);
+  return true;
+}
+
+// Recorders are merged when the thread owning the context flushes
+void flush() {
+  if (!sprites_is_recording()) {
+    sprites_flush(&sprites);
+  }
+}
+
+void set_screen_rect(const SDL_Rect& rect) {
+  screen_rect = rect;
+  glViewport(screen_rect.x, screen_rect.y, screen_rect.w, screen_rect.h);
+}
+
+const SpritesCounters* counters() { return sprites_counters(&sprites); }
+
+const GLStateCounters* gl_counters() { return glstate_counters(); }
+
+bool dump_counters(const char* filename, unsigned int every) {
+  if (counters_file) {
+    fclose(counters_file);
+    counters_file = nullptr;
+  }
+
+  if (!filename) {
+    return true;
+  }
+
+  counters_file = fopen(filename, "w");
+  if (!counters_file) {
+    SDL_LogError(SDL_LOG_CATEGORY_APPLICATION, "Unable to write %s", filename);
+    return false;
+  }
+
+  counters_every = std::max(every, 1u);
+  counters_frames = 0;
+  memset(&counters_sum, 0, sizeof(counters_sum));
+  memset(&gl_counters_sum, 0, sizeof(gl_counters_sum));
+
+  fprintf(counters_file, "frame,draws,instances,bytes,culled,clipped,flushes,binds,binds_skipped");
+  for (int i = 0; i < SPRITES_FLUSH_REASON_COUNT; ++i) {
+    fprintf(counters_file, ",%s",
+            sprites_flush_reason_name(static_cast<SpritesFlushReason>(i)));
+  }
+  fprintf(counters_file, "\n");
+  return true;
+}
+
+// One line of per frame averages every counters_every frames
+static void dump_frame_counters() {
+  const SpritesCounters* s = counters();
+  const GLStateCounters* gl = gl_counters();
+  counters_sum.draws += s->draws;
+  counters_sum.instances += s->instances;
+  counters_sum.bytes += s->bytes;
+  counters_sum.culled += s->culled;
+  counters_sum.clipped += s->clipped;
+  counters_sum.flushes += s->flushes;
+  for (int i = 0; i < SPRITES_FLUSH_REASON_COUNT; ++i) {
+    counters_sum.reasons[i] += s->reasons[i];
+  }
+  gl_counters_sum.binds += gl->binds;
+  gl_counters_sum.binds_skipped += gl->binds_skipped;
+
+  if (++counters_frames % counters_every != 0) {
+    return;
+  }
+
+  double n = counters_every;
+  fprintf(counters_file, "%u,%.1f,%.1f,%.1f,%.1f,%.1f,%.1f,%.1f,%.1f", counters_frames,
+          counters_sum.draws / n, counters_sum.instances / n, counters_sum.bytes / n,
+          counters_sum.culled / n, counters_sum.clipped / n, counters_sum.flushes / n,
+          gl_counters_sum.binds / n, gl_counters_sum.binds_skipped / n);
+  for (int i = 0; i < SPRITES_FLUSH_REASON_COUNT; ++i) {
+    fprintf(counters_file, ",%.1f", counters_sum.reasons[i] / n);
+  }
+  fprintf(counters_file, "\n");
+  fflush(counters_file);
+
+  memset(&counters_sum, 0, sizeof(counters_sum));
+  memset(&gl_counters_sum, 0, sizeof(gl_counters_sum));
+}
+
+void profile(bool enabled, bool overlay) {
+  profiler_enable(enabled);
+  profile_overlay = enabled && overlay;
+}
+
+// Exchanges the draw palette with the given one, doing it again restores the original
+static void swap_palette(int* color_map, int* alpha_map) {
+  std::swap_ranges(color_map, color_map + 16, shader_color_map);
+  std::swap_ranges(alpha_map, alpha_map + 16, shader_alpha_map);
+  sprites_palette_changed(&sprites);
+}
+
+// The screen palette the calling thread changes, other recording threads have none
+static int* current_screen_map() {
+  if (is_worker) {
+    return worker_screen_map;
+  }
+  return sprites_is_recording() ? nullptr : screen.screen_map;
+}
+
+void cls(int c) {
+  if (sprites_is_recording()) {
+    // Recorders can't clear the framebuffer, it becomes an opaque fill of the whole screen
+    int color_map[16];
+    int alpha_map[16] = {};
+    for (int i = 0; i < 16; ++i) {
+      color_map[i] = i;
+    }
+    swap_palette(color_map, alpha_map);
+    sprites_fill(&sprites, 0, 0, VOX_WIDTH, VOX_WIDTH, c);
+    swap_palette(color_map, alpha_map);
+    return;
+  }
+
+  flush();
+  if (indexed) {
+    screen_clear(&screen, c);
+    return;
+  }
+  glClearColor(shader_palette[c].r, shader_palette[c].g, shader_palette[c].b, 1.0f);
+  glClear(GL_COLOR_BUFFER_BIT);
+  glScissor(screen_rect.x, screen_rect.y, screen_rect.w, screen_rect.h);
+}
+
+void pal() {
+  for (int i = 0; i < 16; ++i) {
+    shader_color_map[i] = i;
+  }
+  int* screen_map = current_screen_map();
+  if (screen_map) {
+    for (int i = 0; i < 16; ++i) {
+      screen_map[i] = i;
+    }
+  }
+  sprites_palette_changed(&sprites);
+}
+
+void pal(uint8_t c0, uint8_t c1) {
+  shader_color_map[c0] = c1;
+  sprites_palette_changed(&sprites);
+}
+
+void pal(uint8_t c0, uint8_t c1, int p) {
+  if (p == 1) {
+    int* screen_map = current_screen_map();
+    if (screen_map) {
+      screen_map[c0 & 0x0F] = c1 & 0x0F;
+    }
+  } else {
+    pal(c0, c1);
+  }
+}
+
+void palt() {
+  memset(shader_alpha_map, 0, sizeof(shader_alpha_map));
+  shader_alpha_map[0] = 1;
+  sprites_palette_changed(&sprites);
+}
+
+void palt(int c, bool t) {
+  shader_alpha_map[c] = t;
+  sprites_palette_changed(&sprites);
+}
+
+void layer(int n) { sprites_layer(&sprites, n); }
+
+// The layers of an open bank cache only go through use_bank()
+void bank(int n) {
+  if (n >= 0 && n < static_cast<int>(bank_cache_first_layer(&bank_cache))) {
+    current_bank = n;
+    current_archive_bank = -1;
+  }
+}
+
+bool load_bank(int n, const char* filename) {
+  if (n >= static_cast<int>(bank_cache_first_layer(&bank_cache)) && n < VOX_SPRITE_BANKS) {
+    SDL_LogError(SDL_LOG_CATEGORY_APPLICATION, "Bank %d belongs to the bank cache", n);
+    return false;
+  }
+  return n >= 0 && sprites_load_bank(&sprites, n, filename);
+}
+
+bool open_banks(const char* filename, int budget) {
+  return budget > 0 && bank_cache_open(&bank_cache, filename, budget, sprites.texture);
+}
+
+void close_banks() {
+  BankCacheCounters c = bank_cache_counters(&bank_cache);
+  if (bank_cache.buffer) {
+    SDL_Log("Bank cache: %u hits, %u misses, %u evictions, %u uploads, %u unreadable, %zu bytes",
+            c.hits, c.misses, c.evictions, c.uploads, c.failures, c.bytes);
+  }
+  bank_cache_close(&bank_cache);
+}
+
+bool use_bank(int n) {
+  current_archive_bank = std::max(n, -1);
+  current_bank_frame = bank_cache_frame(&bank_cache);
+  current_bank = n >= 0 ? bank_cache_use(&bank_cache, n) : -1;
+  return current_bank >= 0;
+}
+
+// The layer to draw with, an archive bank can have been evicted or loaded since it was picked
+static int drawing_bank() {
+  if (current_archive_bank >= 0 && current_bank_frame != bank_cache_frame(&bank_cache)) {
+    current_bank_frame = bank_cache_frame(&bank_cache);
+    current_bank = bank_cache_use(&bank_cache, current_archive_bank);
+  }
+  return current_bank;
+}
+
+void prefetch_bank(int n) {
+  if (n >= 0) {
+    bank_cache_prefetch(&bank_cache, n);
+  }
+}
+
+BankCacheCounters bank_counters() { return bank_cache_counters(&bank_cache); }
+
+void sspr(int sx, int sy, int sw, int sh, int dx, int dy, int dw, int dh, bool flipx,
+          bool flipy) {
+  int layer = drawing_bank();
+  if (layer < 0) {
+    return;
+  }
+  sprites_draw(&sprites, layer, sx, sy, sw, sh, dx, dy, dw, dh, flipx, flipy);
+}
+
+void sspr(int sx, int sy, int sw, int sh, int dx, int dy) { sspr(sx, sy, sw, sh, dx, dy, sw, sh); }
+
+void spr(int n, int x, int y, int w, int h, bool flipx, bool flipy) {
+  if (w < 0) w = 0;
+  if (h < 0) h = 0;
+  if (w > VOX_SPRITES_COUNT) w = VOX_SPRITES_COUNT;
+  if (h > VOX_SPRITES_COUNT) h = VOX_SPRITES_COUNT;
+
+  int nx = (n % VOX_SPRITES_COUNT) * VOX_SPRITE_WIDTH;
+  int ny = (n / VOX_SPRITES_COUNT) * VOX_SPRITE_WIDTH;
+
+  w *= VOX_SPRITE_WIDTH;
+  h *= VOX_SPRITE_WIDTH;
+
+  sspr(x, y, w, h, nx, ny, w, h, flipx, flipy);
+}
+
+void rect(int x0, int y0, int x1, int y1, int c) {
+  if (x1 < x0) std::swap(x0, x1);
+  if (y1 < y0) std::swap(y0, y1);
+  int w = (x1 - x0) + 1;
+  int h = (y1 - y0) + 1;
+  sprites_fill(&sprites, x0, y0, w, 1, c);                      // Top
+  if (h > 1) sprites_fill(&sprites, x0, y1, w, 1, c);           // Bottom
+  if (h > 2) {
+    sprites_fill(&sprites, x0, y0 + 1, 1, h - 2, c);            // Left
+    if (w > 1) sprites_fill(&sprites, x1, y0 + 1, 1, h - 2, c); // Right
+  }
+}
+
+void rectfill(int x0, int y0, int x1, int y1, int c) {
+  if (x1 < x0) std::swap(x0, x1);
+  if (y1 < y0) std::swap(y0, y1);
+  sprites_fill(&sprites, x0, y0, (x1 - x0) + 1, (y1 - y0) + 1, c);
+}
+
+void pset(int x, int y, int c) { sprites_fill(&sprites, x, y, 1, 1, c); }
+
+void line(int x0, int y0, int x1, int y1, int c) { sprites_line(&sprites, x0, y0, x1, y1, c); }
+
+void oval(int x0, int y0, int x1, int y1, int c) { sprites_oval(&sprites, x0, y0, x1, y1, c); }
+
+void ovalfill(int x0, int y0, int x1, int y1, int c) {
+  sprites_oval(&sprites, x0, y0, x1, y1, c, true);
+}
+
+void circ(int x, int y, int r, int c) {
+  if (r < 0) return;
+  sprites_oval(&sprites, x - r, y - r, x + r, y + r, c);
+}
+
+void circfill(int x, int y, int r, int c) {
+  if (r < 0) return;
+  sprites_oval(&sprites, x - r, y - r, x + r, y + r, c, true);
+}
+
+void print(const char* str, int x, int y, uint8_t c) {
+  palt();
+  pal(7, c);
+  for (const char* c = str; *c; ++c) {
+    int nx = (*c % VOX_SPRITES_COUNT) * VOX_SPRITE_WIDTH;
+    int ny = (*c / VOX_SPRITES_COUNT) * VOX_SPRITE_WIDTH;
+    sprites_draw(&sprites, VOX_BANK_FONT, x, y, VOX_SPRITE_WIDTH, VOX_SPRITE_WIDTH, nx, ny,
+                 VOX_SPRITE_WIDTH, VOX_SPRITE_WIDTH);
+    x += VOX_SPRITE_WIDTH / 2;
+  }
+}
+
+void map(int celx, int cely, int sx, int sy, int celw, int celh, uint8_t layers) {
+  int layer = drawing_bank();
+  if (layer < 0) {
+    return;
+  }
+  sprites_map(&sprites, layer, sx, sy, celw * VOX_SPRITE_WIDTH, celh * VOX_SPRITE_WIDTH,
+              celx * VOX_SPRITE_WIDTH, cely * VOX_SPRITE_WIDTH, layers);
+}
+
+uint8_t mget(int x, int y) { return map_get(&tilemap, x, y); }
+
+void mset(int x, int y, uint8_t n) {
+  if (map_get(&tilemap, x, y) != n) {
+    sprites_map_changing(&sprites);
+    map_set(&tilemap, x, y, n);
+  }
+}
+
+uint8_t fget(int n) { return map_get_flags(&tilemap, n); }
+
+bool fget(int n, int f) { return (fget(n) >> f) & 1; }
+
+void fset(int n, uint8_t flags) {
+  if (map_get_flags(&tilemap, n) != flags) {
+    sprites_map_changing(&sprites);
+    map_set_flags(&tilemap, n, flags);
+  }
+}
+
+void fset(int n, int f, bool v) {
+  uint8_t flags = fget(n);
+  uint8_t bit = 1 << f;
+  fset(n, v ? flags | bit : flags & ~bit);
+}
+
+bool load_map(const char* filename) {
+  sprites_map_changing(&sprites);
+  return map_load(&tilemap, filename);
+}
+
+bool save_map(const char* filename) { return map_save(&tilemap, filename); }
+
+void focus_map(int celx, int cely) {
+  sprites_map_changing(&sprites);
+  map_focus(&tilemap, celx, cely);
+}
+
+void rnd_seed(uint64_t seed) { rnd_state = seed; }
+
+uint64_t rnd() {
+  rnd_state += 0x60bee2bee120fc15;
+  __uint128_t tmp;
+  tmp = (__uint128_t)rnd_state * 0xa3b195354a39b70d;
+  uint64_t m1 = (tmp >> 64) ^ tmp;
+  tmp = (__uint128_t)m1 * 0x1b03738712fad5c9;
+  uint64_t m2 = (tmp >> 64) ^ tmp;
+  return m2;
+}
+
+// Averages of the last frames in the top left corner, drawn over everything the game drew
+static void draw_profile_overlay() {
+  ProfilerFrame average;
+  if (!profiler_average(&average, VOX_PROFILE_OVERLAY_FRAMES)) {
+    return;
+  }
+
+  // Not pal(), that would also reset the screen palette
+  int color_map[16];
+  int alpha_map[16] = { 1 };
+  for (int i = 0; i < 16; ++i) {
+    color_map[i] = i;
+  }
+  swap_palette(color_map, alpha_map);
+  int game_layer = sprites.layer;
+  layer(VOX_COMMAND_LAYERS - 1);
+
+  rectfill(0, 0, VOX_WIDTH - 1, 4 * VOX_SPRITE_WIDTH - 1, 1);
+
+  char line[33];
+  snprintf(line, sizeof(line), "frame %.2f gpu %.2f", average.total, average.gpu);
+  print(line, 0, 0, average.gpu_ready ? 7 : 6);
+  snprintf(line, sizeof(line), "upd %.2f drw %.2f", average.phases[PROFILER_UPDATE],
+           average.phases[PROFILER_DRAW]);
+  print(line, 0, VOX_SPRITE_WIDTH);
+  snprintf(line, sizeof(line), "fl %.2f x%u", average.phases[PROFILER_FLUSH], average.flushes);
+  print(line, 0, 2 * VOX_SPRITE_WIDTH);
+  snprintf(line, sizeof(line), "res %.2f swp %.2f", average.phases[PROFILER_RESOLVE],
+           average.phases[PROFILER_SWAP]);
+  print(line, 0, 3 * VOX_SPRITE_WIDTH);
+
+  swap_palette(color_map, alpha_map);
+  sprites.layer = game_layer;
+}
+
+static void run_worker() {
+  is_worker = true;
+  current_bank = worker_bank;
+  current_archive_bank = worker_archive_bank;
+  trace_thread_name("worker");
+
+  Pacer pacer;
+  pacer_init(&pacer, worker_rate);
+  while (worker_running.load(std::memory_order_relaxed)) {
+    unsigned int updates = pacer_wait(&pacer);
+
+    FrameList* list = &frame_lists[list_writing];
+    sprites_begin_recording(&list->recorder, 0);
+    memcpy(shader_color_map, worker_color_map, sizeof(worker_color_map));
+    memcpy(shader_alpha_map, worker_alpha_map, sizeof(worker_alpha_map));
+    {
+      TRACE("update");
+      for (unsigned int i = 0; i < updates; ++i) {
+        update();
+      }
+    }
+    {
+      TRACE("draw");
+      draw();
+    }
+    memcpy(worker_color_map, shader_color_map, sizeof(worker_color_map));
+    memcpy(worker_alpha_map, shader_alpha_map, sizeof(worker_alpha_map));
+    sprites_end_recording();
+    memcpy(list->screen_map, worker_screen_map, sizeof(worker_screen_map));
+
+    // A list that was never drawn is simply recorded over, the map changes it carried go
+    // with the next one. What the frame changed on the map is only uploaded with its list.
+    {
+      std::lock_guard<std::mutex> lock(lists_mutex);
+      if (list_fresh) {
+        sprites_carry_map_changes(&list->recorder, &frame_lists[list_ready].recorder);
+      }
+      map_take_changes(&tilemap, &list->recorder.map_changes);
+      std::swap(list_writing, list_ready);
+      list_fresh = true;
+    }
+    lists_changed.notify_one();
+  }
+}
+
+bool start_worker(unsigned int rate) {
+  if (threaded || rate == 0) {
+    return false;
+  }
+
+  // The palettes carry over like they do from frame to frame
+  memcpy(worker_screen_map, screen.screen_map, sizeof(worker_screen_map));
+  memcpy(worker_color_map, shader_color_map, sizeof(worker_color_map));
+  memcpy(worker_alpha_map, shader_alpha_map, sizeof(worker_alpha_map));
+  worker_bank = current_bank;
+  worker_archive_bank = current_archive_bank;
+  map_hold(&tilemap, true);
+  worker_rate = rate;
+  list_fresh = false;
+  worker_running = true;
+  worker = std::thread(run_worker);
+  threaded = true;
+  return true;
+}
+
+void stop_worker() {
+  if (!threaded) {
+    return;
+  }
+
+  worker_running = false;
+  worker.join();
+  threaded = false;
+
+  // The last list may not have been drawn, the tiles it changed still need to get there
+  if (list_fresh) {
+    const MapChanges* changes = &frame_lists[list_ready].recorder.map_changes;
+    map_upload_changes(&tilemap, changes, 0, changes->uploads.size());
+    list_fresh = false;
+  }
+  map_hold(&tilemap, false);
+}
+
+static FrameList* take_frame_list() {
+  std::unique_lock<std::mutex> lock(lists_mutex);
+  if (!lists_changed.wait_for(lock, std::chrono::milliseconds(VOX_FRAME_WAIT_MS),
+                              [] { return list_fresh; })) {
+    return nullptr;
+  }
+  std::swap(list_reading, list_ready);
+  list_fresh = false;
+  return &frame_lists[list_reading];
+}
+
+bool frame(unsigned int framebuffer, unsigned int updates) {
+  FrameList* list = nullptr;
+  if (threaded) {
+    list = take_frame_list();
+    if (!list) {
+      return false;
+    }
+  }
+
+  profiler_begin_frame();
+  TRACE("frame");
+  sprites.frame.bytes += bank_cache_upload(&bank_cache);
+
+  glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+  glViewport(screen_rect.x, screen_rect.y, screen_rect.w, screen_rect.h);
+  glClearColor(0.0, 0.0, 0.0, 1.0);
+  glClear(GL_COLOR_BUFFER_BIT);
+
+  if (indexed) {
+    screen_begin(&screen);
+  } else {
+    glEnable(GL_SCISSOR_TEST);
+  }
+
+  if (list) {
+    memcpy(screen.screen_map, list->screen_map, sizeof(screen.screen_map));
+    sprites_submit(&sprites, &list->recorder);
+    // Merged right away so the overlay ends up on top
+    flush();
+  } else {
+    {
+      ProfilerScope scope(PROFILER_UPDATE);
+      TRACE("update");
+      for (unsigned int i = 0; i < updates; ++i) {
+        update();
+      }
+    }
+    {
+      ProfilerScope scope(PROFILER_DRAW);
+      TRACE("draw");
+      draw();
+    }
+  }
+
+  if (profile_overlay) {
+    draw_profile_overlay();
+  }
+  sprites_end_frame(&sprites);
+
+  if (indexed) {
+    ProfilerScope scope(PROFILER_RESOLVE);
+    TRACE_GL("screen_resolve");
+    screen_resolve(&screen, screen_rect, framebuffer);
+  } else {
+    glDisable(GL_SCISSOR_TEST);
+  }
+
+  glstate_end_frame();
+
+  if (counters_file) {
+    dump_frame_counters();
+  }
+
+  return true;
+}
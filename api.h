@@ -0,0 +1,94 @@
+#ifndef API_H
+#define API_H
+
+#include "banks.h"
+#include "map.h"
+#include "vox.h"
+
+#include <SDL_rect.h>
+#include <stdint.h>
+
+struct GLStateCounters;
+struct SpritesCounters;
+
+// The drawing API games are written against. The game provides update() and draw(),
+// frame() runs update() at the fixed steps that are due and then draw() once, unless a
+// worker does that.
+void update();
+void draw();
+
+// indexed draws into the screen framebuffer, otherwise straight to the target
+bool init(bool indexed = true, unsigned int sprites_flags = 0);
+void set_screen_rect(const SDL_Rect& rect); // Where the screen goes in the target framebuffer
+bool frame(unsigned int framebuffer, unsigned int updates = 1); // False if nothing was drawn
+void flush();
+const SpritesCounters* counters();    // Sprite counters of the last frame
+const GLStateCounters* gl_counters(); // GL binding counters of the last frame
+// Writes the counters averaged over every few frames to filename as CSV, null stops it
+bool dump_counters(const char* filename, unsigned int every = 60);
+void profile(bool enabled, bool overlay = false); // Times frames, see profiler.h
+
+// Runs update() and draw() on a worker thread at rate updates per second, recording into
+// triple buffered draw lists. frame() then draws the newest finished list instead and
+// returns false if none was finished in time. The palettes carry over from frame to frame
+// on the worker too.
+bool start_worker(unsigned int rate);
+void stop_worker();
+
+void cls(int c = 0);
+void pal();
+void pal(uint8_t c0, uint8_t c1);
+void pal(uint8_t c0, uint8_t c1, int p); // p = 1 changes the screen palette (indexed mode only)
+void palt();
+void palt(int c, bool t);
+void layer(int n = 0); // Later layers are drawn on top of earlier ones, only in deferred mode
+// Sprite sheets go in banks 1 to VOX_SPRITE_BANKS - 1, bank 0 holds the font. Switching banks
+// doesn't end the batch and each thread drawing has its own current bank, the worker starts
+// with the main thread's. load_bank() uploads right away so it belongs on the main thread.
+void bank(int n = VOX_BANK_GAME);
+bool load_bank(int n, const char* filename);
+// Streams banks from an archive, see banks.h, keeping budget of them in the last layers of the
+// sprite texture. use_bank() is bank() for archive bank n, while it's still loading, or for
+// good if it couldn't be read, it returns false and spr(), sspr() and map() draw nothing.
+// Drawing with it keeps it in the cache from frame to frame. Until close_banks(), which logs
+// the cache counters, bank() and load_bank() leave those layers alone.
+bool open_banks(const char* filename, int budget);
+void close_banks();
+bool use_bank(int n);
+void prefetch_bank(int n); // Starts loading a bank the game is about to use
+BankCacheCounters bank_counters();
+
+void sspr(int sx, int sy, int sw, int sh, int dx, int dy, int dw, int dh, bool flipx = false,
+          bool flipy = false);
+void sspr(int sx, int sy, int sw, int sh, int dx, int dy);
+void spr(int n, int x, int y, int w = 1, int h = 1, bool flipx = false, bool flipy = false);
+void print(const char* str, int x, int y, uint8_t c = 7);
+
+void rect(int x0, int y0, int x1, int y1, int c = 7);
+void rectfill(int x0, int y0, int x1, int y1, int c = 7);
+void pset(int x, int y, int c = 7);
+void line(int x0, int y0, int x1, int y1, int c = 7);
+void oval(int x0, int y0, int x1, int y1, int c = 7);
+void ovalfill(int x0, int y0, int x1, int y1, int c = 7);
+void circ(int x, int y, int r, int c = 7);
+void circfill(int x, int y, int r, int c = 7);
+
+// The map is drawn with the tiles and flags it has when map() is called, changing it draws
+// the map() calls still pending first. Only the VOX_MAP_WINDOW tiles around the focus can be
+// drawn.
+void map(int celx, int cely, int sx, int sy, int celw = VOX_MAP_WIDTH, int celh = VOX_MAP_HEIGHT,
+         uint8_t layers = 0); // Only tiles whose sprites have every flag in layers
+uint8_t mget(int x, int y);
+void mset(int x, int y, uint8_t n);
+uint8_t fget(int n);
+bool fget(int n, int f);
+void fset(int n, uint8_t flags);
+void fset(int n, int f, bool v);
+bool load_map(const char* filename); // A level file of any size, see map.h
+bool save_map(const char* filename);
+void focus_map(int celx, int cely); // Usually where the camera is, before drawing the map
+
+uint64_t rnd();
+void rnd_seed(uint64_t seed);
+
+#endif // API_H
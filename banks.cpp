@@ -0,0 +1,356 @@
+#include "banks.h"
+
+#include "glstate.h"
+#include "image.h"
+#include "trace.h"
+
+#include <SDL_log.h>
+#include <epoxy/gl.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define VOX_BANK_MISSING -1
+#define VOX_BANK_LOADING -2
+#define VOX_BANK_FAILED -3
+
+static bool bank_cache_has_staging(const BankCache* cache) {
+  for (int i = 0; i < VOX_BANK_STAGING; ++i) {
+    if (cache->stagings[i].state == BANK_STAGING_FREE) {
+      return true;
+    }
+  }
+  return false;
+}
+
+static void bank_cache_load(BankCache* cache) {
+  trace_thread_name("banks");
+
+  std::unique_lock<std::mutex> lock(cache->mutex);
+  while (true) {
+    cache->wake.wait(lock, [cache] {
+      return !cache->running || (!cache->queue.empty() && bank_cache_has_staging(cache));
+    });
+    if (!cache->running) {
+      return;
+    }
+
+    unsigned int bank = cache->queue.front();
+    cache->queue.pop_front();
+    int index = 0;
+    while (cache->stagings[index].state != BANK_STAGING_FREE) {
+      ++index;
+    }
+    BankStaging* staging = &cache->stagings[index];
+    staging->state = BANK_STAGING_LOADING;
+    staging->bank = bank;
+
+    // Nothing else touches the staging area until it's ready
+    lock.unlock();
+    off_t offset = VOX_BANKS_FILE_DATA + static_cast<off_t>(bank) * VOX_BANK_SIZE;
+    bool loaded;
+    {
+      TRACE("bank_cache_load");
+      loaded = pread(cache->fd, cache->staging + index * VOX_BANK_SIZE, VOX_BANK_SIZE, offset) ==
+               VOX_BANK_SIZE;
+    }
+    lock.lock();
+
+    if (loaded) {
+      staging->state = BANK_STAGING_READY;
+      cache->counters.bytes += VOX_BANK_SIZE;
+    } else {
+      // A truncated or broken archive won't read any better the next time
+      SDL_LogError(SDL_LOG_CATEGORY_APPLICATION, "Unable to read bank %u", bank);
+      staging->state = BANK_STAGING_FREE;
+      cache->layers[bank] = VOX_BANK_FAILED;
+      ++cache->counters.failures;
+    }
+  }
+}
+
+static bool bank_cache_create_buffer(BankCache* cache) {
+  size_t size = VOX_BANK_STAGING * VOX_BANK_SIZE;
+  cache->persistent =
+    epoxy_gl_version() >= 44 || epoxy_has_gl_extension("GL_ARB_buffer_storage");
+
+  glGenBuffers(1, &cache->buffer);
+  glstate_bind_buffer(GL_PIXEL_UNPACK_BUFFER, cache->buffer);
+  if (cache->persistent) {
+    // The loader reads straight into the mapping, a staging area is only reused once the
+    // fence of its copy has signaled
+    GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+    glBufferStorage(GL_PIXEL_UNPACK_BUFFER, size, nullptr, flags);
+    cache->staging =
+      static_cast<uint8_t*>(glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, size, flags));
+  } else {
+    glBufferData(GL_PIXEL_UNPACK_BUFFER, size, nullptr, GL_STREAM_DRAW);
+    cache->staging = new uint8_t[size];
+  }
+  glstate_bind_buffer(GL_PIXEL_UNPACK_BUFFER, 0);
+
+  if (!cache->staging) {
+    SDL_LogError(SDL_LOG_CATEGORY_APPLICATION, "Unable to map the bank staging buffer");
+    glDeleteBuffers(1, &cache->buffer);
+    cache->buffer = 0;
+    return false;
+  }
+  return true;
+}
+
+bool bank_cache_open(BankCache* cache, const char* filename, unsigned int budget,
+                     unsigned int texture) {
+  if (budget < 1 || budget > VOX_BANK_CACHE_MAX) {
+    SDL_LogError(SDL_LOG_CATEGORY_APPLICATION, "The bank cache holds 1 to %d banks",
+                 VOX_BANK_CACHE_MAX);
+    return false;
+  }
+
+  int fd = open(filename, O_RDONLY);
+  if (fd < 0) {
+    SDL_LogError(SDL_LOG_CATEGORY_APPLICATION, "Unable to open %s", filename);
+    return false;
+  }
+
+  struct stat st;
+  BankFileHeader header;
+  bool valid = fstat(fd, &st) == 0 && pread(fd, &header, sizeof(header), 0) == sizeof(header) &&
+               memcmp(header.magic, VOX_BANKS_FILE_MAGIC, 4) == 0 &&
+               static_cast<size_t>(st.st_size) >=
+                 VOX_BANKS_FILE_DATA + size_t(header.count) * VOX_BANK_SIZE;
+  if (!valid) {
+    SDL_LogError(SDL_LOG_CATEGORY_APPLICATION, "%s isn't a bank archive", filename);
+    close(fd);
+    return false;
+  }
+
+  // Banks are only read when asked for, in no particular order
+  posix_fadvise(fd, 0, 0, POSIX_FADV_RANDOM);
+
+  bank_cache_close(cache);
+  if (!bank_cache_create_buffer(cache)) {
+    close(fd);
+    return false;
+  }
+
+  cache->fd = fd;
+  cache->count = header.count;
+  cache->budget = budget;
+  cache->texture = texture;
+  cache->layers.assign(header.count, VOX_BANK_MISSING);
+  for (int i = 0; i < VOX_BANK_CACHE_MAX; ++i) {
+    cache->slot_banks[i] = VOX_BANK_MISSING;
+    cache->slot_used[i] = 0;
+  }
+  cache->frame = 0;
+  cache->queue.clear();
+  for (int i = 0; i < VOX_BANK_STAGING; ++i) {
+    cache->stagings[i].state = BANK_STAGING_FREE;
+    cache->stagings[i].fence = nullptr;
+  }
+  memset(&cache->counters, 0, sizeof(cache->counters));
+
+  cache->running = true;
+  cache->loader = std::thread(bank_cache_load, cache);
+  return true;
+}
+
+void bank_cache_close(BankCache* cache) {
+  if (!cache->buffer) {
+    return;
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(cache->mutex);
+    cache->running = false;
+  }
+  cache->wake.notify_one();
+  cache->loader.join();
+
+  for (int i = 0; i < VOX_BANK_STAGING; ++i) {
+    if (cache->stagings[i].fence) {
+      glDeleteSync(cache->stagings[i].fence);
+      cache->stagings[i].fence = nullptr;
+    }
+  }
+  if (cache->persistent) {
+    glstate_bind_buffer(GL_PIXEL_UNPACK_BUFFER, cache->buffer);
+    glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+    glstate_bind_buffer(GL_PIXEL_UNPACK_BUFFER, 0);
+  } else {
+    delete[] cache->staging;
+  }
+  glDeleteBuffers(1, &cache->buffer);
+  close(cache->fd);
+
+  cache->buffer = 0;
+  cache->staging = nullptr;
+  cache->fd = -1;
+  cache->count = 0;
+  cache->layers.clear();
+}
+
+int bank_cache_use(BankCache* cache, unsigned int bank) {
+  std::lock_guard<std::mutex> lock(cache->mutex);
+  if (bank >= cache->count) {
+    return VOX_BANK_MISSING;
+  }
+
+  int layer = cache->layers[bank];
+  if (layer >= 0) {
+    ++cache->counters.hits;
+    cache->slot_used[layer - (VOX_SPRITE_BANKS - cache->budget)] = cache->frame;
+    return layer;
+  }
+
+  if (layer == VOX_BANK_FAILED) {
+    return VOX_BANK_MISSING;
+  }
+
+  ++cache->counters.misses;
+  if (layer == VOX_BANK_MISSING) {
+    cache->layers[bank] = VOX_BANK_LOADING;
+    cache->queue.push_back(bank);
+    cache->wake.notify_one();
+  }
+  return VOX_BANK_MISSING;
+}
+
+void bank_cache_prefetch(BankCache* cache, unsigned int bank) {
+  std::lock_guard<std::mutex> lock(cache->mutex);
+  if (bank < cache->count && cache->layers[bank] == VOX_BANK_MISSING) {
+    cache->layers[bank] = VOX_BANK_LOADING;
+    cache->queue.push_back(bank);
+    cache->wake.notify_one();
+  }
+}
+
+// An empty slot, otherwise the least recently used one nothing in flight can still draw
+static int bank_cache_find_slot(const BankCache* cache) {
+  int slot = -1;
+  for (unsigned int i = 0; i < cache->budget; ++i) {
+    if (cache->slot_banks[i] == VOX_BANK_MISSING) {
+      return i;
+    }
+    if (cache->slot_used[i] + VOX_BANK_CACHE_GRACE < cache->frame &&
+        (slot < 0 || cache->slot_used[i] < cache->slot_used[slot])) {
+      slot = i;
+    }
+  }
+  return slot;
+}
+
+size_t bank_cache_upload(BankCache* cache) {
+  if (!cache->buffer) {
+    return 0;
+  }
+
+  std::lock_guard<std::mutex> lock(cache->mutex);
+  ++cache->frame;
+
+  bool freed = false;
+  for (int i = 0; i < VOX_BANK_STAGING; ++i) {
+    BankStaging* staging = &cache->stagings[i];
+    if (staging->state == BANK_STAGING_UPLOADING &&
+        glClientWaitSync(staging->fence, 0, 0) != GL_TIMEOUT_EXPIRED) {
+      glDeleteSync(staging->fence);
+      staging->fence = nullptr;
+      staging->state = BANK_STAGING_FREE;
+      freed = true;
+    }
+  }
+
+  size_t bytes = 0;
+  for (int i = 0; i < VOX_BANK_STAGING; ++i) {
+    BankStaging* staging = &cache->stagings[i];
+    if (staging->state != BANK_STAGING_READY) {
+      continue;
+    }
+
+    // Stays staged until a bank has gone unused long enough
+    int slot = bank_cache_find_slot(cache);
+    if (slot < 0) {
+      break;
+    }
+
+    TRACE_GL("bank_cache_upload");
+    if (cache->slot_banks[slot] != VOX_BANK_MISSING) {
+      cache->layers[cache->slot_banks[slot]] = VOX_BANK_MISSING;
+      ++cache->counters.evictions;
+    }
+
+    int layer = VOX_SPRITE_BANKS - cache->budget + slot;
+    size_t offset = i * VOX_BANK_SIZE;
+    glstate_bind_buffer(GL_PIXEL_UNPACK_BUFFER, cache->buffer);
+    if (!cache->persistent) {
+      glBufferSubData(GL_PIXEL_UNPACK_BUFFER, offset, VOX_BANK_SIZE, cache->staging + offset);
+    }
+    glstate_bind_texture(0, GL_TEXTURE_2D_ARRAY, cache->texture);
+    // The bind is skipped when the texture is already there, not necessarily on the active unit
+    glstate_active_texture(0);
+    glTexSubImage3D(GL_TEXTURE_2D_ARRAY, 0, 0, 0, layer, VOX_SPRITES_WIDTH, VOX_SPRITES_WIDTH, 1,
+                    GL_RED_INTEGER, GL_UNSIGNED_BYTE, reinterpret_cast<void*>(offset));
+    // Other uploads read from client memory
+    glstate_bind_buffer(GL_PIXEL_UNPACK_BUFFER, 0);
+
+    if (cache->persistent) {
+      staging->fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+      staging->state = BANK_STAGING_UPLOADING;
+    } else {
+      staging->state = BANK_STAGING_FREE;
+      freed = true;
+    }
+
+    cache->slot_banks[slot] = staging->bank;
+    cache->slot_used[slot] = cache->frame;
+    cache->layers[staging->bank] = layer;
+    ++cache->counters.uploads;
+    bytes += VOX_BANK_SIZE;
+  }
+
+  if (freed) {
+    cache->wake.notify_one();
+  }
+  return bytes;
+}
+
+BankCacheCounters bank_cache_counters(BankCache* cache) {
+  std::lock_guard<std::mutex> lock(cache->mutex);
+  return cache->counters;
+}
+
+uint64_t bank_cache_frame(const BankCache* cache) {
+  return cache->frame.load(std::memory_order_relaxed);
+}
+
+unsigned int bank_cache_first_layer(const BankCache* cache) {
+  return cache->buffer ? VOX_SPRITE_BANKS - cache->budget : VOX_SPRITE_BANKS;
+}
+
+bool bank_cache_pack(const char* filename, const char* const* images, unsigned int count) {
+  FILE* f = fopen(filename, "wb");
+  if (!f) {
+    SDL_LogError(SDL_LOG_CATEGORY_APPLICATION, "Unable to write %s", filename);
+    return false;
+  }
+
+  BankFileHeader header = {};
+  memcpy(header.magic, VOX_BANKS_FILE_MAGIC, 4);
+  header.count = count;
+  uint8_t padding[VOX_BANKS_FILE_DATA - sizeof(header)] = {};
+  fwrite(&header, sizeof(header), 1, f);
+  fwrite(padding, sizeof(padding), 1, f);
+
+  bool written = true;
+  for (unsigned int i = 0; i < count && written; ++i) {
+    uint8_t* data = image_load(images[i]);
+    written = data && fwrite(data, VOX_BANK_SIZE, 1, f) == 1;
+    delete[] data;
+  }
+  written &= !ferror(f);
+  fclose(f);
+
+  return written;
+}
@@ -0,0 +1,100 @@
+#ifndef BANKS_H
+#define BANKS_H
+
+#include "vox.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <stddef.h>
+#include <stdint.h>
+#include <thread>
+#include <vector>
+
+#define VOX_BANK_SIZE (VOX_SPRITES_WIDTH * VOX_SPRITES_WIDTH) // Bytes of one sheet
+#define VOX_BANK_CACHE_MAX (VOX_SPRITE_BANKS - VOX_BANK_GAME - 1) // Layers after the game sheet
+#define VOX_BANK_STAGING 4 // Banks read ahead into the unpack buffer
+// Frames a bank is kept after its last use, worker lists and deferred draws still refer to it
+#define VOX_BANK_CACHE_GRACE 3
+
+// Archives are a BankFileHeader and then the color indices of every bank from
+// VOX_BANKS_FILE_DATA on, VOX_BANK_SIZE bytes each
+#define VOX_BANKS_FILE_MAGIC "VOXB"
+#define VOX_BANKS_FILE_DATA 4096
+
+typedef struct __GLsync* GLsync;
+
+struct BankFileHeader {
+  char magic[4];
+  uint32_t count;
+  uint32_t reserved[2];
+};
+
+struct BankCacheCounters {
+  unsigned int hits;      // bank_cache_use() calls that found the bank on the GPU
+  unsigned int misses;    // Calls that had to wait for it
+  unsigned int evictions; // Banks dropped to make room
+  unsigned int uploads;
+  unsigned int failures; // Banks that couldn't be read, they're never asked for again
+  size_t bytes;          // Read from the archive
+};
+
+enum BankStagingState {
+  BANK_STAGING_FREE,
+  BANK_STAGING_LOADING,   // The loader is reading into it
+  BANK_STAGING_READY,     // Waiting for a layer
+  BANK_STAGING_UPLOADING, // Until the copy's fence signals
+};
+
+struct BankStaging {
+  BankStagingState state;
+  unsigned int bank;
+  GLsync fence;
+};
+
+// Banks of an archive streamed into the last layers of the sprite texture. The ones asked for
+// are read on a background thread into an unpack buffer, uploaded from there by
+// bank_cache_upload() and stay until the least recently used one has to make room.
+struct BankCache {
+  int fd;
+  unsigned int count;  // Banks in the archive
+  unsigned int budget; // Layers the cache owns, from VOX_SPRITE_BANKS - budget on
+  unsigned int texture;
+  // Layer of each bank, -1 if it isn't there, -2 while it's loading, -3 if it couldn't be read
+  std::vector<int> layers;
+  int slot_banks[VOX_BANK_CACHE_MAX]; // Bank in each layer or -1
+  uint64_t slot_used[VOX_BANK_CACHE_MAX]; // Frame of the last use
+  std::atomic<uint64_t> frame; // Counts bank_cache_upload() calls
+  std::deque<unsigned int> queue;
+
+  unsigned int buffer; // Unpack buffer with VOX_BANK_STAGING banks
+  bool persistent;
+  uint8_t* staging; // Mapped buffer, or memory on the CPU copied over when uploading
+  BankStaging stagings[VOX_BANK_STAGING];
+
+  std::mutex mutex;
+  std::condition_variable wake;
+  std::thread loader;
+  bool running;
+  BankCacheCounters counters;
+};
+
+// Takes over the last budget layers of texture, the sprite texture array
+bool bank_cache_open(BankCache* cache, const char* filename, unsigned int budget,
+                     unsigned int texture);
+void bank_cache_close(BankCache* cache);
+// The layer holding the bank, otherwise -1 and it's loaded in the background unless reading it
+// failed before. Any thread.
+int bank_cache_use(BankCache* cache, unsigned int bank);
+void bank_cache_prefetch(BankCache* cache, unsigned int bank);
+size_t bank_cache_upload(BankCache* cache); // Once per frame, returns the bytes uploaded
+BankCacheCounters bank_cache_counters(BankCache* cache);
+uint64_t bank_cache_frame(const BankCache* cache); // Any thread, without waiting for the loader
+// The first layer the cache owns, VOX_SPRITE_BANKS while it's closed
+unsigned int bank_cache_first_layer(const BankCache* cache);
+
+// Writes the sheets into an archive, bank n is images[n]
+bool bank_cache_pack(const char* filename, const char* const* images, unsigned int count);
+
+#endif // BANKS_H
@@ -0,0 +1,274 @@
+#include "api.h"
+#include "headless.h"
+#include "sprites.h"
+#include "vox.h"
+
+#include <SDL_log.h>
+#include <SDL_timer.h>
+#include <epoxy/gl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+
+// Draws named scenes headless for a fixed number of frames and reports per frame averages
+// as JSON. Every frame reseeds rnd() so runs are reproducible.
+
+#define BENCH_DEFAULT_FRAMES 120
+#define BENCH_WARMUP_FRAMES 5
+#define BENCH_MAP_SIZE 64 // Tiles per side of the scrolling map
+
+struct BenchScene {
+  const char* name;
+  void (*draw)(int frame);
+};
+
+struct BenchResult {
+  const char* name;
+  double cpu_ms;
+  double gpu_ms;
+  double draws;
+  double instances;
+  double flushes;
+  double culled;
+};
+
+static const BenchScene* bench_scene;
+static int bench_frame;
+static uint64_t bench_seed = 1;
+
+static void bench_sprite_storm(int frame) {
+  cls();
+  palt();
+  pal();
+  palt(14, true);
+  for (int i = 0; i < 20000; ++i) {
+    spr(16 * 5 + rnd() % 8, rnd() % 128, rnd() % 128);
+  }
+}
+
+static void bench_text_wall(int frame) {
+  cls();
+  char line[33];
+  for (int pass = 0; pass < 10; ++pass) {
+    for (int row = 0; row < VOX_WIDTH / VOX_SPRITE_WIDTH; ++row) {
+      for (int i = 0; i < 32; ++i) {
+        line[i] = 'a' + rnd() % 26;
+      }
+      line[32] = '\0';
+      print(line, 0, row * VOX_SPRITE_WIDTH, rnd() % 15 + 1);
+    }
+  }
+}
+
+static void bench_rect_flood(int frame) {
+  cls();
+  palt();
+  pal();
+  for (int i = 0; i < 100000; ++i) {
+    int x = rnd() % 128, y = rnd() % 128;
+    rect(x, y, x + 1, y + 1, rnd() % 15 + 1);
+  }
+}
+
+static void bench_primitive_storm(int frame) {
+  cls();
+  palt();
+  pal();
+  int lastx = rnd() % 128, lasty = rnd() % 128;
+  for (int i = 0; i < 10000; ++i) {
+    int x = rnd() % 128, y = rnd() % 128;
+    line(lastx, lasty, x, y, rnd() % 15 + 1);
+    lastx = x;
+    lasty = y;
+  }
+  for (int i = 0; i < 1000; ++i) {
+    circ(rnd() % 128, rnd() % 128, rnd() % 32, rnd() % 15 + 1);
+    circfill(rnd() % 128, rnd() % 128, rnd() % 8, rnd() % 15 + 1);
+    int x = rnd() % 128, y = rnd() % 128;
+    oval(x, y, x + rnd() % 40, y + rnd() % 20, rnd() % 15 + 1);
+  }
+}
+
+static void bench_palette_swap(int frame) {
+  cls();
+  palt();
+  pal();
+  for (int i = 0; i < 5000; ++i) {
+    pal(rnd() % 16, rnd() % 16);
+    palt(rnd() % 16, rnd() % 2);
+    spr(rnd() % 256, rnd() % 128, rnd() % 128);
+  }
+}
+
+// Two layers of a map much larger than the screen, drawn whole so most of it is off screen
+static void bench_scrolling_map(int frame) {
+  static uint8_t tiles[BENCH_MAP_SIZE][BENCH_MAP_SIZE];
+  if (frame == 0) {
+    for (int y = 0; y < BENCH_MAP_SIZE; ++y) {
+      for (int x = 0; x < BENCH_MAP_SIZE; ++x) {
+        tiles[y][x] = rnd() % 256;
+      }
+    }
+  }
+
+  cls(1);
+  palt();
+  pal();
+
+  int extent = BENCH_MAP_SIZE * VOX_SPRITE_WIDTH - VOX_WIDTH;
+  for (int depth = 2; depth >= 1; --depth) {
+    int cx = (frame * 3 / depth) % extent;
+    int cy = (frame / depth) % extent;
+    for (int y = 0; y < BENCH_MAP_SIZE; ++y) {
+      for (int x = 0; x < BENCH_MAP_SIZE; ++x) {
+        spr(tiles[y][x], x * VOX_SPRITE_WIDTH - cx, y * VOX_SPRITE_WIDTH - cy);
+      }
+    }
+    palt(0, true);
+  }
+}
+
+static const BenchScene bench_scenes[] = {
+  { "sprite_storm", bench_sprite_storm },
+  { "text_wall", bench_text_wall },
+  { "rect_flood", bench_rect_flood },
+  { "primitive_storm", bench_primitive_storm },
+  { "palette_swap", bench_palette_swap },
+  { "scrolling_map", bench_scrolling_map },
+};
+
+void update() {}
+
+void draw() {
+  rnd_seed(bench_seed + bench_frame);
+  bench_scene->draw(bench_frame);
+}
+
+static BenchResult bench_run(const BenchScene* scene, Headless* headless, int frames) {
+  bench_scene = scene;
+
+  for (bench_frame = 0; bench_frame < BENCH_WARMUP_FRAMES; ++bench_frame) {
+    frame(headless->fbo);
+  }
+
+  std::vector<unsigned int> queries(frames);
+  glGenQueries(frames, queries.data());
+
+  BenchResult result = {};
+  result.name = scene->name;
+
+  uint64_t cpu_ticks = 0;
+  for (int i = 0; i < frames; ++i, ++bench_frame) {
+    glBeginQuery(GL_TIME_ELAPSED, queries[i]);
+    uint64_t start = SDL_GetPerformanceCounter();
+    frame(headless->fbo);
+    cpu_ticks += SDL_GetPerformanceCounter() - start;
+    glEndQuery(GL_TIME_ELAPSED);
+
+    const SpritesCounters* frame_counters = counters();
+    result.draws += frame_counters->draws;
+    result.instances += frame_counters->instances;
+    result.flushes += frame_counters->flushes;
+    result.culled += frame_counters->culled;
+  }
+
+  // Only read back once everything has been submitted so the queries never stall a frame
+  uint64_t gpu_ns = 0;
+  for (int i = 0; i < frames; ++i) {
+    GLuint64 elapsed;
+    glGetQueryObjectui64v(queries[i], GL_QUERY_RESULT, &elapsed);
+    gpu_ns += elapsed;
+  }
+  glDeleteQueries(frames, queries.data());
+
+  result.cpu_ms = 1000.0 * cpu_ticks / SDL_GetPerformanceFrequency() / frames;
+  result.gpu_ms = gpu_ns / 1e6 / frames;
+  result.draws /= frames;
+  result.instances /= frames;
+  result.flushes /= frames;
+  result.culled /= frames;
+  return result;
+}
+
+static void bench_write(FILE* f, const std::vector<BenchResult>& results, int frames) {
+  fprintf(f, "{\n  \"renderer\": \"%s\",\n  \"seed\": %llu,\n  \"frames\": %d,\n  \"scenes\": [\n",
+          glGetString(GL_RENDERER), static_cast<unsigned long long>(bench_seed), frames);
+  for (size_t i = 0; i < results.size(); ++i) {
+    const BenchResult& r = results[i];
+    fprintf(f,
+            "    {\"name\": \"%s\", \"cpu_ms\": %.4f, \"gpu_ms\": %.4f, \"draw_calls\": %.2f, "
+            "\"instances\": %.1f, \"flushes\": %.2f, \"culled\": %.1f}%s\n",
+            r.name, r.cpu_ms, r.gpu_ms, r.draws, r.instances, r.flushes, r.culled,
+            i + 1 < results.size() ? "," : "");
+  }
+  fprintf(f, "  ]\n}\n");
+}
+
+int main(int argc, char* argv[]) {
+  int frames = BENCH_DEFAULT_FRAMES;
+  bool indexed = true;
+  unsigned int sprites_flags = 0;
+  const char* output = nullptr;
+  std::vector<const BenchScene*> scenes;
+
+  for (int i = 1; i < argc; ++i) {
+    if (strcmp(argv[i], "--frames") == 0 && i + 1 < argc) {
+      frames = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc) {
+      bench_seed = strtoull(argv[++i], nullptr, 10);
+    } else if (strcmp(argv[i], "--output") == 0 && i + 1 < argc) {
+      output = argv[++i];
+    } else if (strcmp(argv[i], "--direct") == 0) {
+      indexed = false;
+    } else if (strcmp(argv[i], "--pull") == 0) {
+      sprites_flags |= VOX_SPRITES_VERTEX_PULLING;
+    } else if (strcmp(argv[i], "--deferred") == 0) {
+      sprites_flags |= VOX_SPRITES_DEFERRED;
+    } else if (strcmp(argv[i], "--scene") == 0 && i + 1 < argc) {
+      const char* name = argv[++i];
+      const BenchScene* scene = nullptr;
+      for (const BenchScene& s : bench_scenes) {
+        if (strcmp(s.name, name) == 0) scene = &s;
+      }
+      if (!scene) {
+        SDL_LogError(SDL_LOG_CATEGORY_APPLICATION, "Unknown scene %s", name);
+        return 1;
+      }
+      scenes.push_back(scene);
+    }
+  }
+
+  if (frames <= 0) {
+    SDL_LogError(SDL_LOG_CATEGORY_APPLICATION, "--frames must be positive");
+    return 1;
+  }
+
+  if (scenes.empty()) {
+    for (const BenchScene& s : bench_scenes) {
+      scenes.push_back(&s);
+    }
+  }
+
+  Headless headless;
+  if (!headless_init(&headless, VOX_WIDTH, VOX_WIDTH) || !init(indexed, sprites_flags)) {
+    return 1;
+  }
+  set_screen_rect({ 0, 0, VOX_WIDTH, VOX_WIDTH });
+
+  std::vector<BenchResult> results;
+  for (size_t i = 0; i < scenes.size(); ++i) {
+    results.push_back(bench_run(scenes[i], &headless, frames));
+  }
+
+  FILE* f = output ? fopen(output, "w") : stdout;
+  if (!f) {
+    SDL_LogError(SDL_LOG_CATEGORY_APPLICATION, "Unable to write %s", output);
+    return 1;
+  }
+  bench_write(f, results, frames);
+  if (output) fclose(f);
+
+  headless_destroy(&headless);
+  return 0;
+}
@@ -0,0 +1,388 @@
+#include "api.h"
+#include "color.h"
+#include "headless.h"
+#include "image.h"
+#include "quantize.h"
+#include "screen.hpp"
+#include "sprites.h"
+#include "vox.h"
+
+#include <SDL_log.h>
+#include <algorithm>
+#include <chrono>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <unistd.h>
+#include <vector>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+// Microbenchmarks for the CPU side hot paths. Every benchmark runs a batch of operations per
+// sample, samples are taken after a warmup and reported as per operation median and p99.
+// New variants (SIMD, bulk) are added as more entries in micro_benchmarks.
+
+#define MICRO_DEFAULT_SAMPLES 200
+#define MICRO_WARMUP_SAMPLES 20
+#define MICRO_DATA_SIZE 1024
+#define MICRO_IMAGE_WIDTH 1024 // Source image for quantize_image
+#define MICRO_DEFAULT_THRESHOLD 5.0 // Percent the median may grow before it's a regression
+
+// Implemented by the game, nothing is drawn through frame() here
+void update() {}
+void draw() {}
+
+struct MicroBenchmark {
+  const char* name;
+  int operations; // Per sample
+  bool needs_gl;
+  void (*run)(int operations);
+  void (*reset)(); // Between samples, not timed
+};
+
+struct MicroResult {
+  std::string name;
+  double median; // Cycles per operation
+  double p99;
+  double min;
+};
+
+static volatile uint64_t micro_sink; // Keeps results alive
+static int micro_ints[MICRO_DATA_SIZE];
+static uint8_t micro_colors[MICRO_DATA_SIZE][3];
+static std::string micro_image;
+static std::vector<uint8_t> micro_rgba; // A large source image in palette colors
+static std::vector<uint8_t> micro_noise; // The same size in random colors
+static std::vector<uint8_t> micro_indices;
+static Sprites micro_sprites;
+static Screen micro_screen;
+
+static inline uint64_t micro_ticks() {
+#if defined(__x86_64__) || defined(__i386__)
+  // lfence keeps the timed code from being reordered around the read
+  _mm_lfence();
+  uint64_t t = __rdtsc();
+  _mm_lfence();
+  return t;
+#else
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+           std::chrono::steady_clock::now().time_since_epoch())
+    .count();
+#endif
+}
+
+// Ticks per nanosecond, measured against the steady clock
+static double micro_calibrate() {
+  auto start = std::chrono::steady_clock::now();
+  uint64_t ticks = micro_ticks();
+  while (std::chrono::steady_clock::now() - start < std::chrono::milliseconds(50)) {
+  }
+  uint64_t elapsed_ticks = micro_ticks() - ticks;
+  std::chrono::duration<double, std::nano> elapsed = std::chrono::steady_clock::now() - start;
+  return elapsed_ticks / elapsed.count();
+}
+
+static void micro_rnd(int operations) {
+  uint64_t sum = 0;
+  for (int i = 0; i < operations; ++i) {
+    sum += rnd();
+  }
+  micro_sink = sum;
+}
+
+static void micro_clamp(int operations) {
+  uint64_t sum = 0;
+  for (int i = 0; i < operations; ++i) {
+    sum += sprites_clamp(micro_ints[i & (MICRO_DATA_SIZE - 1)]);
+  }
+  micro_sink = sum;
+}
+
+static void micro_screen_calc_rect(int operations) {
+  uint64_t sum = 0;
+  for (int i = 0; i < operations; ++i) {
+    int size = micro_ints[i & (MICRO_DATA_SIZE - 1)] & 0xFFF;
+    sum += screen_calc_rect(size, size / 2 + 64).w;
+  }
+  micro_sink = sum;
+}
+
+static void micro_color_find_closest(int operations) {
+  uint64_t sum = 0;
+  for (int i = 0; i < operations; ++i) {
+    const uint8_t* c = micro_colors[i & (MICRO_DATA_SIZE - 1)];
+    sum += color_find_closest(c[0], c[1], c[2]);
+  }
+  micro_sink = sum;
+}
+
+static void micro_quantize(const std::vector<uint8_t>& rgba, int operations) {
+  for (int i = 0; i < operations; ++i) {
+    quantize_image(rgba.data(), MICRO_IMAGE_WIDTH * 4, MICRO_IMAGE_WIDTH, MICRO_IMAGE_WIDTH,
+                   micro_indices.data(), MICRO_IMAGE_WIDTH);
+  }
+  micro_sink = micro_indices[0];
+}
+
+static void micro_quantize_image(int operations) { micro_quantize(micro_rgba, operations); }
+
+// Random colors spread over the whole table, the ones in mixed cells go through
+// color_find_closest()
+static void micro_quantize_noise(int operations) { micro_quantize(micro_noise, operations); }
+
+static void micro_image_load(int operations) {
+  for (int i = 0; i < operations; ++i) {
+    uint8_t* data = image_load(micro_image.c_str());
+    micro_sink = data ? data[0] : 0;
+    delete[] data;
+  }
+}
+
+// Grid aligned unscaled sprites, the compact format
+static void micro_sprites_compact(int operations) {
+  for (int i = 0; i < operations; ++i) {
+    int v = micro_ints[i & (MICRO_DATA_SIZE - 1)];
+    sprites_draw(&micro_sprites, VOX_BANK_GAME, v & 0x7F, (v >> 7) & 0x7F, 8, 8, v & 0x78,
+                 v & 0x78, 8, 8);
+  }
+}
+
+// Flipped sprites, the standard format
+static void micro_sprites_standard(int operations) {
+  for (int i = 0; i < operations; ++i) {
+    int v = micro_ints[i & (MICRO_DATA_SIZE - 1)];
+    sprites_draw(&micro_sprites, VOX_BANK_GAME, v & 0x7F, (v >> 7) & 0x7F, 8, 8, v & 0x78,
+                 v & 0x78, 8, 8, true);
+  }
+}
+
+// Scaled sprites larger than the screen, the wide format
+static void micro_sprites_wide(int operations) {
+  for (int i = 0; i < operations; ++i) {
+    int v = micro_ints[i & (MICRO_DATA_SIZE - 1)];
+    sprites_draw(&micro_sprites, VOX_BANK_GAME, -(v & 0x7F), -(v & 0x3F), 256, 256, 0, 0, 16,
+                 16);
+  }
+}
+
+static void micro_sprites_culled(int operations) {
+  for (int i = 0; i < operations; ++i) {
+    int v = micro_ints[i & (MICRO_DATA_SIZE - 1)];
+    sprites_draw(&micro_sprites, VOX_BANK_GAME, VOX_WIDTH + (v & 0x7F), v & 0x7F, 8, 8, 0, 0, 8,
+                 8);
+  }
+}
+
+static void micro_sprites_fill(int operations) {
+  for (int i = 0; i < operations; ++i) {
+    int v = micro_ints[i & (MICRO_DATA_SIZE - 1)];
+    sprites_fill(&micro_sprites, (v & 0xFF) - 64, (v >> 8 & 0xFF) - 64, v & 0x3F, 4, v & 0x0F);
+  }
+}
+
+// Draws what the last sample encoded so the next one starts with an empty batch
+static void micro_sprites_reset() { sprites_end_frame(&micro_sprites); }
+
+static const MicroBenchmark micro_benchmarks[] = {
+  { "rnd", 1024, false, micro_rnd, nullptr },
+  { "clamp", 1024, false, micro_clamp, nullptr },
+  { "screen_calc_rect", 1024, false, micro_screen_calc_rect, nullptr },
+  { "color_find_closest", 1024, false, micro_color_find_closest, nullptr },
+  { "quantize_image/1024", 1, false, micro_quantize_image, nullptr },
+  { "quantize_image/noise", 1, false, micro_quantize_noise, nullptr },
+  { "image_load", 1, false, micro_image_load, nullptr },
+  { "sprites_draw/compact", 1024, true, micro_sprites_compact, micro_sprites_reset },
+  { "sprites_draw/standard", 1024, true, micro_sprites_standard, micro_sprites_reset },
+  { "sprites_draw/wide", 1024, true, micro_sprites_wide, micro_sprites_reset },
+  { "sprites_draw/culled", 1024, true, micro_sprites_culled, micro_sprites_reset },
+  { "sprites_fill", 1024, true, micro_sprites_fill, micro_sprites_reset },
+};
+
+// A sprite sheet sized image with noise for image_load
+static bool micro_write_image() {
+  char path[] = "/tmp/vox_microXXXXXX";
+  int fd = mkstemp(path);
+  if (fd < 0) {
+    return false;
+  }
+
+  std::string ppm = "P6\n128 128\n255\n";
+  for (int i = 0; i < VOX_SPRITES_WIDTH * VOX_SPRITES_WIDTH * 3; ++i) {
+    ppm.push_back(static_cast<char>(rnd()));
+  }
+  bool written = write(fd, ppm.data(), ppm.size()) == static_cast<ssize_t>(ppm.size());
+  close(fd);
+
+  micro_image = path;
+  return written;
+}
+
+static MicroResult micro_run(const MicroBenchmark* benchmark, int samples) {
+  std::vector<double> costs;
+  for (int i = 0; i < MICRO_WARMUP_SAMPLES + samples; ++i) {
+    if (benchmark->reset) benchmark->reset();
+
+    uint64_t start = micro_ticks();
+    benchmark->run(benchmark->operations);
+    uint64_t elapsed = micro_ticks() - start;
+
+    if (i >= MICRO_WARMUP_SAMPLES) {
+      costs.push_back(static_cast<double>(elapsed) / benchmark->operations);
+    }
+  }
+
+  std::sort(costs.begin(), costs.end());
+
+  MicroResult result;
+  result.name = benchmark->name;
+  result.median = costs[costs.size() / 2];
+  result.p99 = costs[std::min(costs.size() - 1, costs.size() * 99 / 100)];
+  result.min = costs[0];
+  return result;
+}
+
+static std::vector<MicroResult> micro_load_baseline(const char* filename) {
+  std::vector<MicroResult> results;
+  FILE* f = fopen(filename, "r");
+  if (!f) {
+    SDL_LogError(SDL_LOG_CATEGORY_APPLICATION, "Unable to read baseline %s", filename);
+    return results;
+  }
+
+  char name[256];
+  MicroResult result;
+  while (fscanf(f, "%255s %lf %lf %lf", name, &result.median, &result.p99, &result.min) == 4) {
+    result.name = name;
+    results.push_back(result);
+  }
+
+  fclose(f);
+  return results;
+}
+
+static bool micro_save_baseline(const char* filename, const std::vector<MicroResult>& results) {
+  FILE* f = fopen(filename, "w");
+  if (!f) {
+    SDL_LogError(SDL_LOG_CATEGORY_APPLICATION, "Unable to write baseline %s", filename);
+    return false;
+  }
+
+  for (size_t i = 0; i < results.size(); ++i) {
+    const MicroResult& r = results[i];
+    fprintf(f, "%s %.4f %.4f %.4f\n", r.name.c_str(), r.median, r.p99, r.min);
+  }
+
+  fclose(f);
+  return true;
+}
+
+int main(int argc, char* argv[]) {
+  int samples = MICRO_DEFAULT_SAMPLES;
+  double threshold = MICRO_DEFAULT_THRESHOLD;
+  const char* filter = nullptr;
+  const char* baseline = nullptr;
+  const char* save = nullptr;
+
+  for (int i = 1; i < argc; ++i) {
+    if (strcmp(argv[i], "--samples") == 0 && i + 1 < argc) {
+      samples = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--filter") == 0 && i + 1 < argc) {
+      filter = argv[++i];
+    } else if (strcmp(argv[i], "--baseline") == 0 && i + 1 < argc) {
+      baseline = argv[++i];
+    } else if (strcmp(argv[i], "--save") == 0 && i + 1 < argc) {
+      save = argv[++i];
+    } else if (strcmp(argv[i], "--threshold") == 0 && i + 1 < argc) {
+      threshold = atof(argv[++i]);
+    }
+  }
+
+  if (samples <= 0) {
+    SDL_LogError(SDL_LOG_CATEGORY_APPLICATION, "--samples must be positive");
+    return 1;
+  }
+
+  rnd_seed(1);
+  for (int i = 0; i < MICRO_DATA_SIZE; ++i) {
+    micro_ints[i] = static_cast<int>(rnd() % 80000) - 40000;
+    micro_colors[i][0] = rnd();
+    micro_colors[i][1] = rnd();
+    micro_colors[i][2] = rnd();
+  }
+  micro_rgba.resize(MICRO_IMAGE_WIDTH * MICRO_IMAGE_WIDTH * 4);
+  micro_indices.resize(MICRO_IMAGE_WIDTH * MICRO_IMAGE_WIDTH);
+  for (size_t i = 0; i < micro_indices.size(); ++i) {
+    Color c = color_palette[rnd() % 16];
+    micro_rgba[i * 4] = c.r;
+    micro_rgba[i * 4 + 1] = c.g;
+    micro_rgba[i * 4 + 2] = c.b;
+    micro_rgba[i * 4 + 3] = 255;
+  }
+  micro_noise.resize(micro_rgba.size());
+  for (size_t i = 0; i < micro_noise.size(); ++i) {
+    micro_noise[i] = (i & 3) == 3 ? 255 : static_cast<uint8_t>(rnd());
+  }
+
+  if (!micro_write_image()) {
+    SDL_LogError(SDL_LOG_CATEGORY_APPLICATION, "Unable to write the test image");
+    return 1;
+  }
+
+  // The sprite benchmarks encode into a real stream, so they need a context
+  Headless headless;
+  bool has_gl = headless_init(&headless, VOX_WIDTH, VOX_WIDTH) && screen_init(&micro_screen) &&
+                sprites_init(&micro_sprites, VOX_SPRITES_INDEXED);
+  if (has_gl) {
+    screen_begin(&micro_screen);
+  } else {
+    SDL_LogWarn(SDL_LOG_CATEGORY_APPLICATION, "No GL context, skipping sprite benchmarks");
+  }
+
+  double ticks_per_ns = micro_calibrate();
+
+  std::vector<MicroResult> previous;
+  if (baseline) {
+    previous = micro_load_baseline(baseline);
+  }
+
+  printf("%-24s %12s %12s %12s %10s\n", "benchmark", "median", "p99", "median ns", "baseline");
+
+  std::vector<MicroResult> results;
+  bool regressed = false;
+  for (const MicroBenchmark& benchmark : micro_benchmarks) {
+    if ((filter && !strstr(benchmark.name, filter)) || (benchmark.needs_gl && !has_gl)) {
+      continue;
+    }
+
+    MicroResult result = micro_run(&benchmark, samples);
+    results.push_back(result);
+
+    char change[32] = "";
+    for (size_t i = 0; i < previous.size(); ++i) {
+      if (previous[i].name == result.name && previous[i].median > 0.0) {
+        double percent = 100.0 * (result.median - previous[i].median) / previous[i].median;
+        snprintf(change, sizeof(change), "%+.1f%%%s", percent, percent > threshold ? " !" : "");
+        regressed |= percent > threshold;
+      }
+    }
+
+    printf("%-24s %12.2f %12.2f %12.2f %10s\n", result.name.c_str(), result.median, result.p99,
+           result.median / ticks_per_ns, change);
+  }
+  printf("(cycles per operation, %.3f ticks/ns)\n", ticks_per_ns);
+
+  unlink(micro_image.c_str());
+
+  if (save && !micro_save_baseline(save, results)) {
+    return 1;
+  }
+
+  if (has_gl) {
+    headless_destroy(&headless);
+  }
+
+  return regressed ? 2 : 0;
+}
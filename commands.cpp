@@ -0,0 +1,88 @@
+#include "commands.h"
+
+#include "sprites.h"
+
+#include <algorithm>
+#include <string.h>
+
+void command_buffer_init(CommandBuffer* buffer) { command_buffer_reset(buffer); }
+
+static int command_cell(int v) {
+  return std::min(std::max(v, 0), VOX_COMMAND_GRID * VOX_COMMAND_CELL - 1) / VOX_COMMAND_CELL;
+}
+
+// Within a layer commands are drawn by level and then format. Every grid cell remembers the
+// highest level * VOX_FORMAT_COUNT + format touching it, a command has to sort at or after
+// that in all the cells it covers. Equal keys keep their submission order.
+void command_buffer_add(CommandBuffer* buffer, const Command& command) {
+  int x0 = command_cell(std::min<int>(command.x, command.x + command.w));
+  int y0 = command_cell(std::min<int>(command.y, command.y + command.h));
+  int x1 = command_cell(std::max<int>(command.x, command.x + command.w) - 1);
+  int y1 = command_cell(std::max<int>(command.y, command.y + command.h) - 1);
+
+  uint32_t* levels = buffer->levels[command.layer];
+
+  uint32_t highest = 0;
+  for (int y = y0; y <= y1; ++y) {
+    for (int x = x0; x <= x1; ++x) {
+      highest = std::max(highest, levels[y * VOX_COMMAND_GRID + x]);
+    }
+  }
+
+  // The lowest level whose key for this format isn't below anything it overlaps
+  uint32_t level = (highest + VOX_FORMAT_COUNT - 1 - command.format) / VOX_FORMAT_COUNT;
+  uint32_t key = std::min(level * VOX_FORMAT_COUNT + command.format, 0xFFFFFFu);
+
+  for (int y = y0; y <= y1; ++y) {
+    for (int x = x0; x <= x1; ++x) {
+      levels[y * VOX_COMMAND_GRID + x] = key;
+    }
+  }
+
+  buffer->commands.push_back(command);
+  buffer->keys.push_back((static_cast<uint32_t>(command.layer) << 24) | key);
+}
+
+// Stable LSD radix sort on the keys, a byte that's the same for every key is skipped
+const uint32_t* command_buffer_sort(CommandBuffer* buffer) {
+  size_t count = buffer->keys.size();
+  const uint32_t* keys = buffer->keys.data();
+
+  buffer->order.resize(count);
+  buffer->scratch.resize(count);
+  for (size_t i = 0; i < count; ++i) {
+    buffer->order[i] = i;
+  }
+
+  for (int shift = 0; shift < 32 && count > 0; shift += 8) {
+    size_t offsets[256] = {};
+    for (size_t i = 0; i < count; ++i) {
+      ++offsets[(keys[i] >> shift) & 0xFF];
+    }
+
+    if (offsets[(keys[0] >> shift) & 0xFF] == count) {
+      continue;
+    }
+
+    size_t sum = 0;
+    for (int i = 0; i < 256; ++i) {
+      size_t n = offsets[i];
+      offsets[i] = sum;
+      sum += n;
+    }
+
+    for (size_t i = 0; i < count; ++i) {
+      uint32_t index = buffer->order[i];
+      buffer->scratch[offsets[(keys[index] >> shift) & 0xFF]++] = index;
+    }
+    buffer->order.swap(buffer->scratch);
+  }
+
+  return buffer->order.data();
+}
+
+void command_buffer_reset(CommandBuffer* buffer) {
+  buffer->commands.clear();
+  buffer->keys.clear();
+  memset(buffer->levels, 0, sizeof(buffer->levels));
+}
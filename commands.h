@@ -0,0 +1,38 @@
+#ifndef COMMANDS_H
+#define COMMANDS_H
+
+#include <stdint.h>
+#include <vector>
+
+// Deferred draws, recorded during the frame and replayed sorted so instances of the same
+// format end up next to each other while overlapping draws keep their order.
+
+#define VOX_COMMAND_LAYERS 8
+#define VOX_COMMAND_CELL 8 // Size of the overlap grid's cells in pixels
+#define VOX_COMMAND_GRID (128 / VOX_COMMAND_CELL)
+
+struct Command {
+  int16_t x, y, w, h;
+  uint32_t params;  // Packed texture rectangle or color
+  uint32_t compact; // Compact encoding without the state
+  uint16_t state;
+  uint8_t type;
+  uint8_t format;
+  uint8_t layer;
+  uint8_t bank;
+};
+
+struct CommandBuffer {
+  std::vector<Command> commands;
+  std::vector<uint32_t> keys; // Layer (bits 24-31), level * VOX_FORMAT_COUNT + format
+  std::vector<uint32_t> order;
+  std::vector<uint32_t> scratch;
+  uint32_t levels[VOX_COMMAND_LAYERS][VOX_COMMAND_GRID * VOX_COMMAND_GRID];
+};
+
+void command_buffer_init(CommandBuffer* buffer);
+void command_buffer_add(CommandBuffer* buffer, const Command& command);
+const uint32_t* command_buffer_sort(CommandBuffer* buffer); // Indices into commands
+void command_buffer_reset(CommandBuffer* buffer);
+
+#endif // COMMANDS_H
@@ -0,0 +1,91 @@
+#include "glstate.h"
+
+#include <epoxy/gl.h>
+#include <string.h>
+
+#define VOX_GLSTATE_UNKNOWN static_cast<unsigned int>(-1)
+#define VOX_GLSTATE_TEXTURE_UNITS 8
+
+struct GLState {
+  unsigned int program;
+  unsigned int vao;
+  unsigned int active_unit;
+  unsigned int texture_targets[VOX_GLSTATE_TEXTURE_UNITS];
+  unsigned int textures[VOX_GLSTATE_TEXTURE_UNITS];
+  unsigned int array_buffer;
+  GLStateCounters frame;
+  GLStateCounters last;
+};
+
+static GLState state;
+
+static bool glstate_changed(unsigned int* current, unsigned int value) {
+  if (*current == value) {
+    state.frame.binds_skipped++;
+    return false;
+  }
+  *current = value;
+  state.frame.binds++;
+  return true;
+}
+
+void glstate_reset() {
+  state.program = VOX_GLSTATE_UNKNOWN;
+  state.vao = VOX_GLSTATE_UNKNOWN;
+  state.active_unit = VOX_GLSTATE_UNKNOWN;
+  for (int i = 0; i < VOX_GLSTATE_TEXTURE_UNITS; ++i) {
+    state.texture_targets[i] = 0;
+    state.textures[i] = VOX_GLSTATE_UNKNOWN;
+  }
+  state.array_buffer = VOX_GLSTATE_UNKNOWN;
+}
+
+void glstate_use_program(unsigned int program) {
+  if (glstate_changed(&state.program, program)) {
+    glUseProgram(program);
+  }
+}
+
+void glstate_bind_vertex_array(unsigned int vao) {
+  if (glstate_changed(&state.vao, vao)) {
+    glBindVertexArray(vao);
+  }
+}
+
+void glstate_active_texture(unsigned int unit) {
+  if (glstate_changed(&state.active_unit, unit)) {
+    glActiveTexture(GL_TEXTURE0 + unit);
+  }
+}
+
+void glstate_bind_texture(unsigned int unit, unsigned int target, unsigned int texture) {
+  if (state.texture_targets[unit] != target) {
+    state.texture_targets[unit] = target;
+    state.textures[unit] = VOX_GLSTATE_UNKNOWN;
+  }
+  if (state.textures[unit] == texture) {
+    state.frame.binds_skipped++;
+    return;
+  }
+  glstate_active_texture(unit);
+  state.textures[unit] = texture;
+  state.frame.binds++;
+  glBindTexture(target, texture);
+}
+
+void glstate_bind_buffer(unsigned int target, unsigned int buffer) {
+  // Only GL_ARRAY_BUFFER is tracked, other targets are VAO state or rarely used
+  if (target != GL_ARRAY_BUFFER) {
+    state.frame.binds++;
+    glBindBuffer(target, buffer);
+  } else if (glstate_changed(&state.array_buffer, buffer)) {
+    glBindBuffer(target, buffer);
+  }
+}
+
+void glstate_end_frame() {
+  state.last = state.frame;
+  memset(&state.frame, 0, sizeof(state.frame));
+}
+
+const GLStateCounters* glstate_counters() { return &state.last; }
@@ -0,0 +1,21 @@
+#ifndef GLSTATE_H
+#define GLSTATE_H
+
+// Tracks the GL bindings the renderer touches so redundant calls can be skipped
+
+struct GLStateCounters {
+  unsigned int binds;
+  unsigned int binds_skipped;
+};
+
+void glstate_reset();
+void glstate_use_program(unsigned int program);
+void glstate_bind_vertex_array(unsigned int vao);
+void glstate_active_texture(unsigned int unit);
+void glstate_bind_texture(unsigned int unit, unsigned int target, unsigned int texture);
+void glstate_bind_buffer(unsigned int target, unsigned int buffer);
+void glstate_end_frame();
+
+const GLStateCounters* glstate_counters(); // Totals for the last completed frame
+
+#endif // GLSTATE_H
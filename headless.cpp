@@ -0,0 +1,137 @@
+#include "headless.h"
+
+#include <SDL_log.h>
+#include <algorithm>
+#include <epoxy/egl.h>
+#include <epoxy/gl.h>
+#include <stdio.h>
+#include <vector>
+
+static EGLConfig headless_choose_config(EGLDisplay display) {
+  if (epoxy_has_egl_extension(display, "EGL_KHR_no_config_context") ||
+      epoxy_has_egl_extension(display, "EGL_MESA_configless_context")) {
+    return EGL_NO_CONFIG_KHR;
+  }
+
+  const EGLint attributes[] = {
+    EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT, EGL_SURFACE_TYPE, EGL_PBUFFER_BIT, EGL_NONE,
+  };
+  EGLConfig config;
+  EGLint count;
+  if (!eglChooseConfig(display, attributes, &config, 1, &count) || count == 0) {
+    return EGL_NO_CONFIG_KHR;
+  }
+  return config;
+}
+
+bool headless_init(Headless* headless, int width, int height) {
+  EGLDisplay display =
+    eglGetPlatformDisplay(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, nullptr);
+  if (display == EGL_NO_DISPLAY) {
+    SDL_LogError(SDL_LOG_CATEGORY_APPLICATION, "Unable to get a surfaceless EGL display");
+    return false;
+  }
+
+  EGLint major, minor;
+  if (!eglInitialize(display, &major, &minor)) {
+    SDL_LogError(SDL_LOG_CATEGORY_APPLICATION, "Unable to initialize EGL: 0x%x", eglGetError());
+    return false;
+  }
+
+  if (!eglBindAPI(EGL_OPENGL_API)) {
+    SDL_LogError(SDL_LOG_CATEGORY_APPLICATION, "EGL has no desktop GL support");
+    eglTerminate(display);
+    return false;
+  }
+
+  const EGLint context_attributes[] = {
+    EGL_CONTEXT_MAJOR_VERSION, 3,
+    EGL_CONTEXT_MINOR_VERSION, 3,
+    EGL_CONTEXT_OPENGL_PROFILE_MASK, EGL_CONTEXT_OPENGL_CORE_PROFILE_BIT,
+    EGL_NONE,
+  };
+  EGLContext context = eglCreateContext(display, headless_choose_config(display), EGL_NO_CONTEXT,
+                                        context_attributes);
+  if (context == EGL_NO_CONTEXT) {
+    SDL_LogError(SDL_LOG_CATEGORY_APPLICATION, "Unable to create GL context: 0x%x",
+                 eglGetError());
+    eglTerminate(display);
+    return false;
+  }
+
+  // There's no surface at all, everything goes into the framebuffer below
+  if (!eglMakeCurrent(display, EGL_NO_SURFACE, EGL_NO_SURFACE, context)) {
+    SDL_LogError(SDL_LOG_CATEGORY_APPLICATION, "Unable to make GL context current: 0x%x",
+                 eglGetError());
+    eglDestroyContext(display, context);
+    eglTerminate(display);
+    return false;
+  }
+
+  headless->display = display;
+  headless->context = context;
+  headless->width = width;
+  headless->height = height;
+
+  glGenRenderbuffers(1, &headless->renderbuffer);
+  glBindRenderbuffer(GL_RENDERBUFFER, headless->renderbuffer);
+  glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, width, height);
+
+  glGenFramebuffers(1, &headless->fbo);
+  glBindFramebuffer(GL_FRAMEBUFFER, headless->fbo);
+  glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER,
+                            headless->renderbuffer);
+
+  if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
+    SDL_LogError(SDL_LOG_CATEGORY_APPLICATION, "Headless framebuffer is incomplete");
+    headless_destroy(headless);
+    return false;
+  }
+
+  return true;
+}
+
+void headless_destroy(Headless* headless) {
+  glDeleteFramebuffers(1, &headless->fbo);
+  glDeleteRenderbuffers(1, &headless->renderbuffer);
+
+  eglMakeCurrent(headless->display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+  eglDestroyContext(headless->display, headless->context);
+  eglTerminate(headless->display);
+}
+
+void headless_read_pixels(Headless* headless, uint8_t* rgb) {
+  int width = headless->width;
+  int height = headless->height;
+
+  glBindFramebuffer(GL_FRAMEBUFFER, headless->fbo);
+  glPixelStorei(GL_PACK_ALIGNMENT, 1);
+  glReadPixels(0, 0, width, height, GL_RGB, GL_UNSIGNED_BYTE, rgb);
+
+  // GL's rows start at the bottom
+  std::vector<uint8_t> row(width * 3);
+  for (int y = 0; y < height / 2; ++y) {
+    uint8_t* top = rgb + y * width * 3;
+    uint8_t* bottom = rgb + (height - 1 - y) * width * 3;
+    std::copy(top, top + width * 3, row.begin());
+    std::copy(bottom, bottom + width * 3, top);
+    std::copy(row.begin(), row.end(), bottom);
+  }
+}
+
+bool headless_write_ppm(Headless* headless, const char* filename) {
+  std::vector<uint8_t> rgb(headless->width * headless->height * 3);
+  headless_read_pixels(headless, rgb.data());
+
+  FILE* f = fopen(filename, "wb");
+  if (!f) {
+    SDL_LogError(SDL_LOG_CATEGORY_APPLICATION, "Unable to write %s", filename);
+    return false;
+  }
+
+  fprintf(f, "P6\n%d %d\n255\n", headless->width, headless->height);
+  bool written = fwrite(rgb.data(), 1, rgb.size(), f) == rgb.size();
+  fclose(f);
+
+  return written;
+}
@@ -0,0 +1,22 @@
+#ifndef HEADLESS_H
+#define HEADLESS_H
+
+#include <stdint.h>
+
+// A GL 3.3 core context without a window or display, through EGL's surfaceless platform
+// (Mesa's llvmpipe works), drawing into an offscreen framebuffer
+struct Headless {
+  void* display; // EGLDisplay
+  void* context; // EGLContext
+  unsigned int fbo;
+  unsigned int renderbuffer;
+  int width;
+  int height;
+};
+
+bool headless_init(Headless* headless, int width, int height);
+void headless_destroy(Headless* headless);
+void headless_read_pixels(Headless* headless, uint8_t* rgb); // width * height * 3, top row first
+bool headless_write_ppm(Headless* headless, const char* filename);
+
+#endif // HEADLESS_H
@@ -1,6 +1,7 @@
 #include "image.h"
 
-#include "color.h"
+#include "quantize.h"
+#include "trace.h"
 #include "vox.h"
 
 #define STB_IMAGE_IMPLEMENTATION
@@ -10,8 +11,10 @@
 #include <algorithm>
 
 uint8_t* image_load(const char* filename) {
+  TRACE("image_load");
   int n, width, height;
-  uint8_t* data = stbi_load(filename, &width, &height, &n, 0);
+  // Always RGBA whatever the file has so rows can be converted in bulk
+  uint8_t* data = stbi_load(filename, &width, &height, &n, 4);
 
   if (!data) {
     SDL_LogError(SDL_LOG_CATEGORY_APPLICATION, "Unable to load image: %s", filename);
@@ -25,12 +28,7 @@ uint8_t* image_load(const char* filename) {
   int minw = std::min(VOX_SPRITES_WIDTH, width);
   int minh = std::min(VOX_SPRITES_WIDTH, height);
 
-  for (int i = 0; i < minw; ++i) {
-    for (int j = 0; j < minh; ++j) {
-      uint8_t* p = &data[j * width * n + i * n];
-      palettized[j * VOX_SPRITES_WIDTH + i] = color_find_closest(p[0], p[1], p[2]);
-    }
-  }
+  quantize_image(data, width * 4, minw, minh, palettized, VOX_SPRITES_WIDTH);
 
   stbi_image_free(data);
 
@@ -1,112 +1,17 @@
-#include "color.h"
-#include "image.h"
+#include "api.h"
+#include "banks.h"
+#include "headless.h"
+#include "pacer.h"
+#include "profiler.h"
 #include "screen.hpp"
-#include "shader.h"
 #include "sprites.h"
+#include "trace.h"
 #include "vox.h"
 
 #include <SDL.h>
 
 #include <epoxy/gl.h>
 
-#include <glm/glm.hpp>
-
-static Sprites sprites;
-static SDL_Rect screen_rect;
-
-bool init() { return sprites_init(&sprites); }
-
-void flush() { sprites_flush(&sprites); }
-
-void cls(int c = 0) {
-  glClearColor(shader_palette[c].r, shader_palette[c].g, shader_palette[c].b, 1.0f);
-  glClear(GL_COLOR_BUFFER_BIT);
-  glScissor(screen_rect.x, screen_rect.y, screen_rect.w, screen_rect.h);
-}
-
-void pal() {
-  flush();
-  for (int i = 0; i < 16; ++i) {
-    shader_color_map[i] = i;
-  }
-}
-
-void pal(uint8_t c0, uint8_t c1) {
-  flush();
-  shader_color_map[c0] = c1;
-}
-
-void palt() {
-  flush();
-  memset(shader_alpha_map, 0, sizeof(shader_alpha_map));
-  shader_alpha_map[0] = 1;
-}
-
-void palt(int c, bool t) {
-  flush();
-  shader_alpha_map[c] = t;
-}
-
-void sspr(int sx, int sy, int sw, int sh, int dx, int dy, int dw, int dh, bool flipx = false,
-          bool flipy = false) {
-  sprites_draw(&sprites, sx, sy, sw, sh, dx, dy + VOX_SPRITES_WIDTH, dw, dh, flipx, flipy);
-}
-
-void sspr(int sx, int sy, int sw, int sh, int dx, int dy) { sspr(sx, sy, sw, sh, dx, dy, sw, sh); }
-
-void spr(int n, int x, int y, int w = 1, int h = 1, bool flipx = false, bool flipy = false) {
-  if (w < 0) w = 0;
-  if (h < 0) h = 0;
-  if (w > VOX_SPRITES_COUNT) w = VOX_SPRITES_COUNT;
-  if (h > VOX_SPRITES_COUNT) h = VOX_SPRITES_COUNT;
-
-  int nx = (n % VOX_SPRITES_COUNT) * VOX_SPRITE_WIDTH;
-  int ny = (n / VOX_SPRITES_COUNT) * VOX_SPRITE_WIDTH;
-
-  w *= VOX_SPRITE_WIDTH;
-  h *= VOX_SPRITE_WIDTH;
-
-  sspr(x, y, w, h, nx, ny, w, h, flipx, flipy);
-}
-
-void rect(int x0, int y0, int x1, int y1, int c = 7) {
-  int w = (x1 - x0) + 1;
-  int h = (y1 - y0) + 1;
-  sprites_draw(&sprites, x0, y0, w, 1, 0, 0, 8, 8); // Top
-  sprites_draw(&sprites, x0, y1, w, 1, 0, 0, 8, 8); // Bottom
-  sprites_draw(&sprites, x0, y0, 1, h, 0, 0, 8, 8); // Left
-  sprites_draw(&sprites, x1, 0, 1, h, 0, 0, 8, 8);  // Right
-}
-
-void rectfill(int x0, int y0, int x1, int y1, int c = 7) {
-  int w = (x1 - x0) + 1;
-  int h = (y1 - y0) + 1;
-  sprites_draw(&sprites, x0, y0, w, h, 0, 0, 8, 8);
-}
-
-void print(const char* str, int x, int y, uint8_t c = 7) {
-  palt();
-  pal(7, c);
-  for (const char* c = str; *c; ++c) {
-    int nx = (*c % VOX_SPRITES_COUNT) * VOX_SPRITE_WIDTH;
-    int ny = (*c / VOX_SPRITES_COUNT) * VOX_SPRITE_WIDTH;
-    sprites_draw(&sprites, x, y, VOX_SPRITE_WIDTH, VOX_SPRITE_WIDTH, nx, ny, VOX_SPRITE_WIDTH,
-                 VOX_SPRITE_WIDTH);
-    x += VOX_SPRITE_WIDTH / 2;
-  }
-}
-
-uint64_t rnd() {
-  static uint64_t wyhash64_x;
-  wyhash64_x += 0x60bee2bee120fc15;
-  __uint128_t tmp;
-  tmp = (__uint128_t)wyhash64_x * 0xa3b195354a39b70d;
-  uint64_t m1 = (tmp >> 64) ^ tmp;
-  tmp = (__uint128_t)m1 * 0x1b03738712fad5c9;
-  uint64_t m2 = (tmp >> 64) ^ tmp;
-  return m2;
-}
-
 void update() {}
 
 void draw() {
@@ -157,9 +62,169 @@ void on_debug_message(GLenum source, GLenum type, GLuint id, GLenum severity, GL
           (type == GL_DEBUG_TYPE_ERROR ? "** GL ERROR **" : ""), type, severity, message);
 }
 
+// -1 is adaptive sync, which falls back to plain vsync where it isn't supported
+static bool set_vsync(int interval) {
+  if (SDL_GL_SetSwapInterval(interval) == 0) {
+    return true;
+  }
+  if (interval == -1 && SDL_GL_SetSwapInterval(1) == 0) {
+    SDL_Log("Adaptive sync isn't supported, using vsync");
+    return true;
+  }
+  SDL_LogError(SDL_LOG_CATEGORY_APPLICATION, "Unable to set the swap interval: %s",
+               SDL_GetError());
+  return false;
+}
+
+// Sets up the renderer and draws the frames, run_headless() cleans up after it either way
+static bool draw_headless(Headless* headless, int frames, bool indexed,
+                          unsigned int sprites_flags, bool profiling, const char* stats,
+                          int stats_every, int threaded_rate) {
+  if (!init(indexed, sprites_flags)) {
+    return false;
+  }
+
+  set_screen_rect({ 0, 0, VOX_WIDTH, VOX_WIDTH });
+  profile(profiling, profiling);
+  if (stats && !dump_counters(stats, stats_every)) {
+    return false;
+  }
+  if (threaded_rate > 0 && !start_worker(threaded_rate)) {
+    return false;
+  }
+  // Frames the worker hasn't finished in time don't count
+  for (int i = 0; i < frames;) {
+    if (frame(headless->fbo)) {
+      ++i;
+    }
+  }
+  return true;
+}
+
+// Runs a number of frames without SDL video and optionally saves the last one
+int run_headless(int frames, const char* output, bool indexed, unsigned int sprites_flags,
+                 bool profiling, const char* trace, const char* stats, int stats_every,
+                 int threaded_rate) {
+  Headless headless;
+  if (!headless_init(&headless, VOX_WIDTH, VOX_WIDTH)) {
+    return 1;
+  }
+
+  SDL_Log("glGetString(GL_VERSION) returns %s\n", glGetString(GL_VERSION));
+
+  trace_enable(trace != nullptr);
+  trace_thread_name("main");
+  bool drawn = draw_headless(&headless, frames, indexed, sprites_flags, profiling, stats,
+                             stats_every, threaded_rate);
+  stop_worker();
+  close_banks();
+
+  ProfilerFrame average;
+  if (drawn && profiling && profiler_average(&average, VOX_PROFILER_FRAMES)) {
+    SDL_Log("frame %.3fms gpu %.3fms update %.3fms draw %.3fms flush %.3fms resolve %.3fms",
+            average.total, average.gpu, average.phases[PROFILER_UPDATE],
+            average.phases[PROFILER_DRAW], average.phases[PROFILER_FLUSH],
+            average.phases[PROFILER_RESOLVE]);
+  }
+
+  dump_counters(nullptr);
+  bool saved = drawn && (!output || headless_write_ppm(&headless, output));
+  if (trace) {
+    saved &= trace_write(trace);
+  }
+  headless_destroy(&headless);
+  return saved ? 0 : 1;
+}
+
 int main(int argc, char* argv[]) {
   // stbi_set_flip_vertically_on_load(true);
 
+  bool indexed = true;
+  unsigned int sprites_flags = 0;
+  bool profiling = false;
+  bool headless = false;
+  int headless_frames = 1;
+  const char* headless_output = nullptr;
+  const char* trace = nullptr;
+  const char* stats = nullptr;
+  int stats_every = 60;
+  int update_rate = 60; // 30 is pico8's _update, 60 its _update60
+  int vsync = 0;
+  bool threaded = false;
+  const char* pack = nullptr; // Archive to write the sheets after it into
+  const char* const* pack_sheets = nullptr;
+  int pack_count = 0;
+
+  for (int i = 1; i < argc; ++i) {
+    if (strcmp(argv[i], "--direct") == 0) {
+      indexed = false;
+    } else if (strcmp(argv[i], "--pull") == 0) {
+      sprites_flags |= VOX_SPRITES_VERTEX_PULLING;
+    } else if (strcmp(argv[i], "--deferred") == 0) {
+      sprites_flags |= VOX_SPRITES_DEFERRED;
+    } else if (strcmp(argv[i], "--profile") == 0) {
+      profiling = true;
+    } else if (strcmp(argv[i], "--trace") == 0 && i + 1 < argc) {
+      trace = argv[++i];
+    } else if (strcmp(argv[i], "--stats") == 0 && i + 1 < argc) {
+      stats = argv[++i];
+    } else if (strcmp(argv[i], "--stats-every") == 0 && i + 1 < argc) {
+      stats_every = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--fps") == 0 && i + 1 < argc) {
+      update_rate = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--vsync") == 0 && i + 1 < argc) {
+      const char* mode = argv[++i];
+      if (strcmp(mode, "off") == 0) {
+        vsync = 0;
+      } else if (strcmp(mode, "on") == 0) {
+        vsync = 1;
+      } else if (strcmp(mode, "adaptive") == 0) {
+        vsync = -1;
+      } else {
+        SDL_LogError(SDL_LOG_CATEGORY_APPLICATION, "--vsync is off, on or adaptive, not %s",
+                     mode);
+        return 1;
+      }
+    } else if (strcmp(argv[i], "--threaded") == 0) {
+      threaded = true;
+    } else if (strcmp(argv[i], "--headless") == 0) {
+      headless = true;
+    } else if (strcmp(argv[i], "--frames") == 0 && i + 1 < argc) {
+      headless_frames = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--output") == 0 && i + 1 < argc) {
+      headless_output = argv[++i];
+    } else if (strcmp(argv[i], "--pack-banks") == 0 && i + 1 < argc) {
+      pack = argv[++i];
+      pack_sheets = argv + i + 1;
+      pack_count = argc - i - 1;
+      break;
+    }
+  }
+
+  // Only writes the archive for open_banks(), bank n is the nth sheet
+  if (pack) {
+    if (pack_count == 0) {
+      SDL_LogError(SDL_LOG_CATEGORY_APPLICATION, "--pack-banks needs the sheets to pack");
+      return 1;
+    }
+    return bank_cache_pack(pack, pack_sheets, pack_count) ? 0 : 1;
+  }
+
+  if (stats_every <= 0) {
+    SDL_LogError(SDL_LOG_CATEGORY_APPLICATION, "--stats-every must be positive");
+    return 1;
+  }
+  // The worker runs at that rate, headless or not
+  if (threaded && update_rate <= 0) {
+    SDL_LogError(SDL_LOG_CATEGORY_APPLICATION, "--fps must be positive with --threaded");
+    return 1;
+  }
+
+  if (headless) {
+    return run_headless(headless_frames, headless_output, indexed, sprites_flags, profiling,
+                        trace, stats, stats_every, threaded ? update_rate : 0);
+  }
+
   if (SDL_Init(SDL_INIT_EVENTS | SDL_INIT_VIDEO) < 0) {
     SDL_LogError(SDL_LOG_CATEGORY_APPLICATION, "Unable to initialize video: %s", SDL_GetError());
     return 1;
@@ -188,13 +253,35 @@ int main(int argc, char* argv[]) {
   glEnable(GL_DEBUG_OUTPUT);
   glDebugMessageCallback(on_debug_message, 0);
 
-  bool is_running = init();
+  trace_enable(trace != nullptr);
+  trace_thread_name("main");
+  // The pacer keeps update() at a fixed rate, vsync only decides whether swapping waits too.
+  // Without it nothing is drawn faster than the update rate either. A driver that won't turn
+  // it off only costs some latency, one that won't turn it on wasn't what was asked for.
+  if (!set_vsync(vsync) && vsync != 0) {
+    return 1;
+  }
+
+  Pacer pacer;
+  bool is_running = pacer_init(&pacer, update_rate > 0 ? update_rate : 0) &&
+                    init(indexed, sprites_flags);
 
-  screen_rect = screen_calc_rect(VOX_DEFAULT_SCREEN_WIDTH, VOX_DEFAULT_SCREEN_HEIGHT);
-  glViewport(screen_rect.x, screen_rect.y, screen_rect.w, screen_rect.h);
+  set_screen_rect(screen_calc_rect(VOX_DEFAULT_SCREEN_WIDTH, VOX_DEFAULT_SCREEN_HEIGHT));
   glLineWidth(8.0);
+  profile(profiling, profiling);
+  if (stats) {
+    is_running &= dump_counters(stats, stats_every);
+  }
 
+  // Threaded, the worker keeps its own pace and frames are drawn as its lists come in
+  if (is_running && threaded) {
+    is_running = start_worker(pacer.rate);
+  }
+
+  pacer_reset(&pacer);
   while (is_running) {
+    unsigned int updates = threaded ? 0 : pacer_wait(&pacer);
+
     SDL_Event event;
     while (SDL_PollEvent(&event)) {
       if (event.type == SDL_QUIT) {
@@ -202,29 +289,44 @@ int main(int argc, char* argv[]) {
         break;
       }
 
+      // F12 saves what has been traced so far
+      if (event.type == SDL_KEYDOWN && event.key.keysym.sym == SDLK_F12 && trace) {
+        trace_write(trace);
+      }
+
       if (event.type == SDL_WINDOWEVENT) {
         switch (event.window.event) {
           case SDL_WINDOWEVENT_RESIZED:
           case SDL_WINDOWEVENT_SIZE_CHANGED: {
-            screen_rect = screen_calc_rect(event.window.data1, event.window.data2);
-            glViewport(screen_rect.x, screen_rect.y, screen_rect.w, screen_rect.h);
+            set_screen_rect(screen_calc_rect(event.window.data1, event.window.data2));
           } break;
         }
       }
     }
 
-    glClearColor(0.0, 0.0, 0.0, 1.0);
-    glClear(GL_COLOR_BUFFER_BIT);
-
-    glEnable(GL_SCISSOR_TEST);
-    update();
-    draw();
-    flush();
-    glDisable(GL_SCISSOR_TEST);
+    if (!frame(0, updates)) {
+      continue;
+    }
 
+    ProfilerScope scope(PROFILER_SWAP);
+    TRACE("swap");
     SDL_GL_SwapWindow(window);
   }
 
+  stop_worker();
+  close_banks();
+  if (trace) {
+    trace_write(trace);
+  }
+  dump_counters(nullptr);
+
+  const PacerCounters* c = &pacer.counters;
+  if (!threaded) {
+    SDL_Log("%u frames, %u updates at %u Hz, %u late frames, %u dropped updates, worst wake "
+            "%.2fms",
+            c->frames, c->updates, pacer.rate, c->late, c->dropped, c->worst_wake_ms);
+  }
+
   SDL_GL_DeleteContext(context);
   SDL_DestroyWindow(window);
   SDL_Quit();
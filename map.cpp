@@ -0,0 +1,471 @@
+#include "map.h"
+
+#include "glstate.h"
+#include "trace.h"
+
+#include <SDL_log.h>
+#include <algorithm>
+#include <epoxy/gl.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static const size_t map_chunk_size = VOX_MAP_CHUNK * VOX_MAP_CHUNK;
+
+static uint8_t* map_chunk(const Map* map, int chunk) {
+  return map->tiles + static_cast<size_t>(chunk) * map_chunk_size;
+}
+
+// True if the chunk is in the resident window
+static bool map_is_resident(const Map* map, int chunk) {
+  int sx = (chunk % map->width) & (VOX_MAP_RESIDENT - 1);
+  int sy = (chunk / map->width) & (VOX_MAP_RESIDENT - 1);
+  return map->slots[sy][sx] == chunk;
+}
+
+static unsigned int map_create_texture(int width, int height) {
+  unsigned int texture;
+  glGenTextures(1, &texture);
+  glBindTexture(GL_TEXTURE_2D, texture);
+
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+
+  glTexImage2D(GL_TEXTURE_2D, 0, GL_R8UI, width, height, 0, GL_RED_INTEGER, GL_UNSIGNED_BYTE,
+               nullptr);
+  return texture;
+}
+
+// Dropping a chunk only works when it covers whole pages, otherwise it's left to the kernel
+static bool map_can_evict() {
+  long page_size = sysconf(_SC_PAGESIZE);
+  return page_size > 0 && map_chunk_size % page_size == 0;
+}
+
+// Unchanged chunks are read from the level file again the next time they're touched, an
+// anonymous map reads zeros which is all an unchanged chunk of it holds
+static void map_evict(Map* map, int chunk) {
+  if (!map->edited[chunk] && map_can_evict()) {
+    madvise(map_chunk(map, chunk), map_chunk_size, MADV_DONTNEED);
+  }
+}
+
+// Chunks outside the window are paged in by reads and changes too, they're remembered so the
+// next map_set_window() can drop them again
+static void map_touch(Map* map, int chunk) {
+  if (map_is_resident(map, chunk)) {
+    return;
+  }
+  std::lock_guard<std::mutex> lock(map->mutex);
+  if (!map->touched[chunk]) {
+    map->touched[chunk] = true;
+    map->touched_chunks.push_back(chunk);
+  }
+}
+
+// Moves the window to start at chunk wx, wy and marks the chunks that came into it
+static void map_set_window(Map* map, int wx, int wy) {
+  wx = std::max(0, std::min(wx, map->width - VOX_MAP_RESIDENT));
+  wy = std::max(0, std::min(wy, map->height - VOX_MAP_RESIDENT));
+
+  for (int chunk : map->touched_chunks) {
+    int cx = chunk % map->width;
+    int cy = chunk / map->width;
+    if (cx < wx || cy < wy || cx >= wx + VOX_MAP_RESIDENT || cy >= wy + VOX_MAP_RESIDENT) {
+      map_evict(map, chunk);
+    }
+    map->touched[chunk] = false;
+  }
+  map->touched_chunks.clear();
+
+  for (int sy = 0; sy < VOX_MAP_RESIDENT; ++sy) {
+    for (int sx = 0; sx < VOX_MAP_RESIDENT; ++sx) {
+      int chunk = map->slots[sy][sx];
+      if (chunk < 0) {
+        continue;
+      }
+      int cx = chunk % map->width;
+      int cy = chunk / map->width;
+      if (cx < wx || cy < wy || cx >= wx + VOX_MAP_RESIDENT || cy >= wy + VOX_MAP_RESIDENT) {
+        map_evict(map, chunk);
+        map->slots[sy][sx] = -1;
+      }
+    }
+  }
+
+  map->window_x = wx;
+  map->window_y = wy;
+  int x1 = std::min(wx + VOX_MAP_RESIDENT, map->width);
+  int y1 = std::min(wy + VOX_MAP_RESIDENT, map->height);
+  for (int cy = wy; cy < y1; ++cy) {
+    for (int cx = wx; cx < x1; ++cx) {
+      int chunk = cy * map->width + cx;
+      int sx = cx & (VOX_MAP_RESIDENT - 1);
+      int sy = cy & (VOX_MAP_RESIDENT - 1);
+      if (map->slots[sy][sx] != chunk) {
+        map->slots[sy][sx] = chunk;
+        map->dirty[sy][sx] = { 0, 0, VOX_MAP_CHUNK, VOX_MAP_CHUNK };
+        map->changed = true;
+      }
+    }
+  }
+}
+
+// Takes over a mapping of width by height chunks, tiles points into it
+static void map_replace(Map* map, uint8_t* mapping, size_t mapping_size, uint8_t* tiles,
+                        int width, int height) {
+  if (map->mapping) {
+    munmap(map->mapping, map->mapping_size);
+  }
+  map->mapping = mapping;
+  map->mapping_size = mapping_size;
+  map->tiles = tiles;
+  map->width = width;
+  map->height = height;
+  map->edited.assign(static_cast<size_t>(width) * height, false);
+  map->touched.assign(static_cast<size_t>(width) * height, false);
+  map->touched_chunks.clear();
+
+  for (int sy = 0; sy < VOX_MAP_RESIDENT; ++sy) {
+    for (int sx = 0; sx < VOX_MAP_RESIDENT; ++sx) {
+      map->slots[sy][sx] = -1;
+    }
+  }
+  map_set_window(map, map->window_x, map->window_y);
+  map->flags_dirty = true;
+  map->changed = true;
+}
+
+bool map_init(Map* map, int width, int height) {
+  map->texture = map_create_texture(VOX_MAP_WINDOW, VOX_MAP_WINDOW);
+  map->flags_texture = map_create_texture(VOX_MAP_SPRITES, 1);
+
+  // Bindings were changed directly while setting up
+  glstate_reset();
+
+  int chunks_x = std::max(1, (width + VOX_MAP_CHUNK - 1) / VOX_MAP_CHUNK);
+  int chunks_y = std::max(1, (height + VOX_MAP_CHUNK - 1) / VOX_MAP_CHUNK);
+  size_t size = static_cast<size_t>(chunks_x) * chunks_y * map_chunk_size;
+  void* mapping = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (mapping == MAP_FAILED) {
+    SDL_LogError(SDL_LOG_CATEGORY_APPLICATION, "Unable to allocate a %dx%d map", width, height);
+    return false;
+  }
+
+  std::lock_guard<std::mutex> lock(map->mutex);
+  memset(map->flags, 0, sizeof(map->flags));
+  map->held = false;
+  map->mapping = nullptr;
+  map->window_x = 0;
+  map->window_y = 0;
+  uint8_t* tiles = static_cast<uint8_t*>(mapping);
+  map_replace(map, tiles, size, tiles, chunks_x, chunks_y);
+
+  return true;
+}
+
+bool map_load(Map* map, const char* filename) {
+  int fd = open(filename, O_RDONLY);
+  if (fd < 0) {
+    SDL_LogError(SDL_LOG_CATEGORY_APPLICATION, "Unable to open %s", filename);
+    return false;
+  }
+
+  struct stat st;
+  MapFileHeader header;
+  bool valid = fstat(fd, &st) == 0 && pread(fd, &header, sizeof(header), 0) == sizeof(header) &&
+               memcmp(header.magic, VOX_MAP_FILE_MAGIC, 4) == 0 && header.width > 0 &&
+               header.height > 0 && header.width <= INT16_MAX && header.height <= INT16_MAX &&
+               static_cast<size_t>(st.st_size) >=
+                 VOX_MAP_FILE_TILES + size_t(header.width) * header.height * map_chunk_size;
+  if (!valid) {
+    SDL_LogError(SDL_LOG_CATEGORY_APPLICATION, "%s isn't a level file", filename);
+    close(fd);
+    return false;
+  }
+
+  // Private so tiles can be changed without writing them back to the file
+  void* mapping = mmap(nullptr, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (mapping == MAP_FAILED) {
+    SDL_LogError(SDL_LOG_CATEGORY_APPLICATION, "Unable to map %s", filename);
+    return false;
+  }
+
+  // Chunks are touched where the game is, reading ahead would only page in chunks that are
+  // then left behind
+  madvise(mapping, st.st_size, MADV_RANDOM);
+
+  uint8_t* data = static_cast<uint8_t*>(mapping);
+  std::lock_guard<std::mutex> lock(map->mutex);
+  memcpy(map->flags, data + sizeof(header), sizeof(map->flags));
+  map_replace(map, data, st.st_size, data + VOX_MAP_FILE_TILES, header.width, header.height);
+
+  return true;
+}
+
+// Writes a new file next to the old one and renames it over it, the old file may still be
+// mapped by map_load() and truncating it would take away the pages unchanged chunks read
+bool map_save(Map* map, const char* filename) {
+  std::string temp(filename);
+  temp += ".XXXXXX";
+  int fd = mkstemp(&temp[0]);
+  FILE* f = fd >= 0 ? fdopen(fd, "wb") : nullptr;
+  if (!f) {
+    SDL_LogError(SDL_LOG_CATEGORY_APPLICATION, "Unable to write %s", filename);
+    if (fd >= 0) {
+      close(fd);
+      unlink(temp.c_str());
+    }
+    return false;
+  }
+
+  MapFileHeader header;
+  uint8_t flags[VOX_MAP_SPRITES];
+  int chunks;
+  {
+    std::lock_guard<std::mutex> lock(map->mutex);
+    memcpy(header.magic, VOX_MAP_FILE_MAGIC, 4);
+    header.width = map->width;
+    header.height = map->height;
+    header.reserved = 0;
+    memcpy(flags, map->flags, sizeof(flags));
+    chunks = map->width * map->height;
+  }
+
+  uint8_t padding[VOX_MAP_FILE_TILES - sizeof(header) - VOX_MAP_SPRITES] = {};
+  fwrite(&header, sizeof(header), 1, f);
+  fwrite(flags, sizeof(flags), 1, f);
+  fwrite(padding, sizeof(padding), 1, f);
+
+  // The lock is only held while a chunk is copied, chunks the copy paged in are dropped again
+  std::vector<uint8_t> chunk(map_chunk_size);
+  for (int i = 0; i < chunks; ++i) {
+    {
+      std::lock_guard<std::mutex> lock(map->mutex);
+      memcpy(chunk.data(), map_chunk(map, i), map_chunk_size);
+      if (!map_is_resident(map, i)) {
+        map_evict(map, i);
+      }
+    }
+    fwrite(chunk.data(), map_chunk_size, 1, f);
+  }
+
+  bool written = !ferror(f);
+  written &= fclose(f) == 0;
+  if (!written || rename(temp.c_str(), filename) != 0) {
+    SDL_LogError(SDL_LOG_CATEGORY_APPLICATION, "Unable to write %s", filename);
+    unlink(temp.c_str());
+    return false;
+  }
+
+  return true;
+}
+
+void map_focus(Map* map, int x, int y) {
+  // The window starts at the chunk boundary closest to half a window before the tile
+  int offset = VOX_MAP_CHUNK / 2 - VOX_MAP_WINDOW / 2;
+  std::lock_guard<std::mutex> lock(map->mutex);
+  map_set_window(map, (x + offset) / VOX_MAP_CHUNK, (y + offset) / VOX_MAP_CHUNK);
+}
+
+size_t map_upload(Map* map) {
+  std::lock_guard<std::mutex> lock(map->mutex);
+  if (!map->changed || map->held) {
+    return 0;
+  }
+
+  TRACE_GL("map_upload");
+  size_t bytes = 0;
+  if (map->flags_dirty) {
+    glstate_bind_texture(0, GL_TEXTURE_2D, map->flags_texture);
+    glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, VOX_MAP_SPRITES, 1, GL_RED_INTEGER, GL_UNSIGNED_BYTE,
+                    map->flags);
+    bytes += sizeof(map->flags);
+    map->flags_dirty = false;
+  }
+
+  // Each chunk only uploads the rectangle that changed, straight from the mapping
+  glstate_bind_texture(0, GL_TEXTURE_2D, map->texture);
+  glPixelStorei(GL_UNPACK_ROW_LENGTH, VOX_MAP_CHUNK);
+  for (int sy = 0; sy < VOX_MAP_RESIDENT; ++sy) {
+    for (int sx = 0; sx < VOX_MAP_RESIDENT; ++sx) {
+      MapDirty* dirty = &map->dirty[sy][sx];
+      int chunk = map->slots[sy][sx];
+      if (chunk >= 0 && dirty->x0 < dirty->x1 && dirty->y0 < dirty->y1) {
+        int w = dirty->x1 - dirty->x0;
+        int h = dirty->y1 - dirty->y0;
+        const uint8_t* data = map_chunk(map, chunk) + dirty->y0 * VOX_MAP_CHUNK + dirty->x0;
+        glTexSubImage2D(GL_TEXTURE_2D, 0, sx * VOX_MAP_CHUNK + dirty->x0,
+                        sy * VOX_MAP_CHUNK + dirty->y0, w, h, GL_RED_INTEGER, GL_UNSIGNED_BYTE,
+                        data);
+        bytes += w * h;
+      }
+      *dirty = { 0, 0, 0, 0 };
+    }
+  }
+  glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+  map->changed = false;
+
+  return bytes;
+}
+
+void map_hold(Map* map, bool held) {
+  std::lock_guard<std::mutex> lock(map->mutex);
+  map->held = held;
+}
+
+static void map_add_upload(MapChanges* changes, bool flags, int x, int y, int w, int h) {
+  MapUpload upload;
+  upload.flags = flags;
+  upload.x = x;
+  upload.y = y;
+  upload.w = w;
+  upload.h = h;
+  upload.offset = changes->tiles.size();
+  changes->uploads.push_back(upload);
+}
+
+void map_take_changes(Map* map, MapChanges* changes) {
+  std::lock_guard<std::mutex> lock(map->mutex);
+  if (!map->changed) {
+    return;
+  }
+
+  if (map->flags_dirty) {
+    map_add_upload(changes, true, 0, 0, VOX_MAP_SPRITES, 1);
+    changes->tiles.insert(changes->tiles.end(), map->flags, map->flags + VOX_MAP_SPRITES);
+    map->flags_dirty = false;
+  }
+
+  for (int sy = 0; sy < VOX_MAP_RESIDENT; ++sy) {
+    for (int sx = 0; sx < VOX_MAP_RESIDENT; ++sx) {
+      MapDirty* dirty = &map->dirty[sy][sx];
+      int chunk = map->slots[sy][sx];
+      if (chunk >= 0 && dirty->x0 < dirty->x1 && dirty->y0 < dirty->y1) {
+        int w = dirty->x1 - dirty->x0;
+        int h = dirty->y1 - dirty->y0;
+        map_add_upload(changes, false, sx * VOX_MAP_CHUNK + dirty->x0,
+                       sy * VOX_MAP_CHUNK + dirty->y0, w, h);
+        // Rows are padded to the default unpack alignment of 4
+        size_t row = (w + 3) & ~3;
+        size_t offset = changes->tiles.size();
+        changes->tiles.resize(offset + row * h);
+        const uint8_t* data = map_chunk(map, chunk) + dirty->y0 * VOX_MAP_CHUNK + dirty->x0;
+        for (int y = 0; y < h; ++y) {
+          memcpy(&changes->tiles[offset + y * row], data, w);
+          data += VOX_MAP_CHUNK;
+        }
+      }
+      *dirty = { 0, 0, 0, 0 };
+    }
+  }
+  map->changed = false;
+}
+
+void map_prepend_changes(MapChanges* changes, const MapChanges* earlier) {
+  for (MapUpload& upload : changes->uploads) {
+    upload.offset += earlier->tiles.size();
+  }
+  changes->uploads.insert(changes->uploads.begin(), earlier->uploads.begin(),
+                          earlier->uploads.end());
+  changes->tiles.insert(changes->tiles.begin(), earlier->tiles.begin(), earlier->tiles.end());
+}
+
+void map_clear_changes(MapChanges* changes) {
+  changes->uploads.clear();
+  changes->tiles.clear();
+}
+
+size_t map_upload_changes(Map* map, const MapChanges* changes, size_t first, size_t last) {
+  if (first >= last) {
+    return 0;
+  }
+
+  TRACE_GL("map_upload_changes");
+  size_t bytes = 0;
+  for (size_t i = first; i < last; ++i) {
+    const MapUpload& upload = changes->uploads[i];
+    glstate_bind_texture(0, GL_TEXTURE_2D, upload.flags ? map->flags_texture : map->texture);
+    glTexSubImage2D(GL_TEXTURE_2D, 0, upload.x, upload.y, upload.w, upload.h, GL_RED_INTEGER,
+                    GL_UNSIGNED_BYTE, &changes->tiles[upload.offset]);
+    bytes += upload.w * upload.h;
+  }
+  return bytes;
+}
+
+void map_resident(const Map* map, int* x, int* y, int* w, int* h) {
+  *x = map->window_x * VOX_MAP_CHUNK;
+  *y = map->window_y * VOX_MAP_CHUNK;
+  *w = std::min(VOX_MAP_RESIDENT, map->width - map->window_x) * VOX_MAP_CHUNK;
+  *h = std::min(VOX_MAP_RESIDENT, map->height - map->window_y) * VOX_MAP_CHUNK;
+}
+
+static bool map_inside(const Map* map, int x, int y) {
+  return x >= 0 && y >= 0 && x < map->width * VOX_MAP_CHUNK && y < map->height * VOX_MAP_CHUNK;
+}
+
+uint8_t map_get(Map* map, int x, int y) {
+  if (!map_inside(map, x, y)) {
+    return 0;
+  }
+  int chunk = (y / VOX_MAP_CHUNK) * map->width + x / VOX_MAP_CHUNK;
+  map_touch(map, chunk);
+  return map_chunk(map, chunk)[(y % VOX_MAP_CHUNK) * VOX_MAP_CHUNK + x % VOX_MAP_CHUNK];
+}
+
+void map_set(Map* map, int x, int y, uint8_t n) {
+  if (!map_inside(map, x, y)) {
+    return;
+  }
+
+  int cx = x / VOX_MAP_CHUNK;
+  int cy = y / VOX_MAP_CHUNK;
+  int chunk = cy * map->width + cx;
+  map_touch(map, chunk);
+  x %= VOX_MAP_CHUNK;
+  y %= VOX_MAP_CHUNK;
+  uint8_t* tile = map_chunk(map, chunk) + y * VOX_MAP_CHUNK + x;
+  if (*tile == n) {
+    return;
+  }
+
+  std::lock_guard<std::mutex> lock(map->mutex);
+  *tile = n;
+  map->edited[chunk] = true;
+
+  // Chunks outside the window are uploaded whole when they come into it
+  int sx = cx & (VOX_MAP_RESIDENT - 1);
+  int sy = cy & (VOX_MAP_RESIDENT - 1);
+  if (map->slots[sy][sx] == chunk) {
+    MapDirty* dirty = &map->dirty[sy][sx];
+    if (dirty->x0 >= dirty->x1) {
+      *dirty = { static_cast<uint8_t>(x), static_cast<uint8_t>(y), static_cast<uint8_t>(x + 1),
+                 static_cast<uint8_t>(y + 1) };
+    } else {
+      dirty->x0 = std::min<int>(dirty->x0, x);
+      dirty->y0 = std::min<int>(dirty->y0, y);
+      dirty->x1 = std::max<int>(dirty->x1, x + 1);
+      dirty->y1 = std::max<int>(dirty->y1, y + 1);
+    }
+    map->changed = true;
+  }
+}
+
+uint8_t map_get_flags(const Map* map, int n) {
+  return n >= 0 && n < VOX_MAP_SPRITES ? map->flags[n] : 0;
+}
+
+void map_set_flags(Map* map, int n, uint8_t flags) {
+  if (n >= 0 && n < VOX_MAP_SPRITES) {
+    std::lock_guard<std::mutex> lock(map->mutex);
+    map->flags[n] = flags;
+    map->flags_dirty = true;
+    map->changed = true;
+  }
+}
@@ -0,0 +1,96 @@
+#ifndef MAP_H
+#define MAP_H
+
+#include <mutex>
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+#define VOX_MAP_WIDTH 128 // In tiles, the size of the empty map a game starts with like pico8's
+#define VOX_MAP_HEIGHT 64
+#define VOX_MAP_SPRITES 256 // Sprites on the sheet that have flags
+
+#define VOX_MAP_CHUNK 64   // Tiles per side of a chunk, a chunk is one 4 KiB page
+#define VOX_MAP_RESIDENT 4 // Chunks per side of the window on the GPU, a power of 2
+#define VOX_MAP_WINDOW (VOX_MAP_RESIDENT * VOX_MAP_CHUNK) // Tiles per side of the texture
+
+// Level files are a MapFileHeader, the sprite flags and then the tiles from
+// VOX_MAP_FILE_TILES on, chunk after chunk in rows of chunks
+#define VOX_MAP_FILE_MAGIC "VOXM"
+#define VOX_MAP_FILE_TILES 4096
+
+struct MapFileHeader {
+  char magic[4];
+  uint32_t width; // In chunks
+  uint32_t height;
+  uint32_t reserved;
+};
+
+// Tiles changed in a resident chunk, empty when x0 >= x1
+struct MapDirty {
+  uint8_t x0, y0, x1, y1;
+};
+
+// Part of the tile texture, or the flags texture, to copy from MapChanges::tiles
+struct MapUpload {
+  bool flags;
+  uint16_t x, y, w, h;
+  size_t offset;
+};
+
+// Changes taken out of a map to be uploaded later, draws recorded on another thread are then
+// drawn with the tiles they were recorded with rather than what the map holds by then
+struct MapChanges {
+  std::vector<MapUpload> uploads; // In order, later ones may cover earlier ones
+  std::vector<uint8_t> tiles;
+};
+
+// A map of any size. All of it is memory mapped, from the level file or anonymous memory,
+// chunks are paged in when touched and the ones left outside the window are dropped again the
+// next time it's set unless they were changed. Only the window around the focus is kept on
+// the GPU, in a texture that wraps around so moving the window only uploads the chunks that
+// came into it.
+struct Map {
+  int width; // In chunks
+  int height;
+  uint8_t* tiles;                 // Sprite numbers chunk after chunk, 0 is never drawn
+  uint8_t flags[VOX_MAP_SPRITES]; // Sprite flags, map() filters tiles by them
+  bool flags_dirty;
+  bool changed; // Something is waiting for map_upload()
+  bool held;    // Changes wait for map_take_changes(), map_upload() leaves them
+  std::vector<bool> edited; // Chunks that differ from the level file
+  std::vector<bool> touched; // Chunks outside the window paged in since it was last set
+  std::vector<int> touched_chunks;
+  uint8_t* mapping;
+  size_t mapping_size;
+
+  int window_x; // First resident chunk
+  int window_y;
+  int slots[VOX_MAP_RESIDENT][VOX_MAP_RESIDENT]; // Chunk in each part of the texture or -1
+  MapDirty dirty[VOX_MAP_RESIDENT][VOX_MAP_RESIDENT];
+  std::mutex mutex; // Changes can come from the update thread while frame() uploads
+
+  unsigned int texture;       // R8UI tile numbers, VOX_MAP_WINDOW square
+  unsigned int flags_texture; // R8UI, one texel per sprite
+};
+
+bool map_init(Map* map, int width = VOX_MAP_WIDTH, int height = VOX_MAP_HEIGHT); // In tiles
+bool map_load(Map* map, const char* filename);
+bool map_save(Map* map, const char* filename);
+void map_focus(Map* map, int x, int y); // Centers the resident window on a tile
+size_t map_upload(Map* map);            // Returns the bytes uploaded, 0 if nothing changed
+void map_hold(Map* map, bool held);
+void map_take_changes(Map* map, MapChanges* changes); // Appends them to what changes holds
+void map_prepend_changes(MapChanges* changes, const MapChanges* earlier);
+void map_clear_changes(MapChanges* changes);
+// Uploads changes->uploads[first, last), returns the bytes uploaded
+size_t map_upload_changes(Map* map, const MapChanges* changes, size_t first, size_t last);
+// Where the resident window overlaps the map in tiles, the only part that can be drawn
+void map_resident(const Map* map, int* x, int* y, int* w, int* h);
+
+uint8_t map_get(Map* map, int x, int y); // 0 outside the map
+void map_set(Map* map, int x, int y, uint8_t n);
+uint8_t map_get_flags(const Map* map, int n);
+void map_set_flags(Map* map, int n, uint8_t flags);
+
+#endif // MAP_H
@@ -0,0 +1,58 @@
+#include "pacer.h"
+
+#include <SDL_log.h>
+#include <SDL_timer.h>
+#include <string.h>
+
+bool pacer_init(Pacer* pacer, unsigned int rate) {
+  if (rate == 0) {
+    SDL_LogError(SDL_LOG_CATEGORY_APPLICATION, "Update rate must be positive");
+    return false;
+  }
+
+  pacer->rate = rate;
+  pacer->frequency = SDL_GetPerformanceFrequency();
+  pacer->step = pacer->frequency / rate;
+  memset(&pacer->counters, 0, sizeof(pacer->counters));
+  pacer_reset(pacer);
+
+  return true;
+}
+
+void pacer_reset(Pacer* pacer) { pacer->next = SDL_GetPerformanceCounter(); }
+
+unsigned int pacer_wait(Pacer* pacer) {
+  uint64_t now = SDL_GetPerformanceCounter();
+  if (now < pacer->next) {
+    // SDL_Delay can oversleep by a millisecond or more, the rest is spun away
+    uint64_t margin = pacer->frequency * VOX_PACER_SPIN_US / 1000000;
+    if (pacer->next - now > margin) {
+      SDL_Delay(static_cast<Uint32>((pacer->next - now - margin) * 1000 / pacer->frequency));
+    }
+    while ((now = SDL_GetPerformanceCounter()) < pacer->next) {
+    }
+  }
+
+  // Every step whose deadline has passed is due
+  uint64_t deadline = pacer->next;
+  uint64_t due = (now - deadline) / pacer->step + 1;
+  pacer->next = deadline + due * pacer->step;
+
+  double wake_ms = 1000.0 * (now - deadline) / pacer->frequency;
+  if (due == 1 && wake_ms > pacer->counters.worst_wake_ms) {
+    pacer->counters.worst_wake_ms = wake_ms;
+  }
+
+  unsigned int updates = due;
+  if (due > VOX_PACER_MAX_STEPS) {
+    updates = VOX_PACER_MAX_STEPS;
+    pacer->counters.dropped += due - VOX_PACER_MAX_STEPS;
+  }
+  if (due > 1) {
+    ++pacer->counters.late;
+  }
+
+  ++pacer->counters.frames;
+  pacer->counters.updates += updates;
+  return updates;
+}
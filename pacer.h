@@ -0,0 +1,31 @@
+#ifndef PACER_H
+#define PACER_H
+
+#include <stdint.h>
+
+#define VOX_PACER_SPIN_US 2000 // Sleep until this close to a deadline, then spin
+#define VOX_PACER_MAX_STEPS 4  // Catch up updates per frame, steps beyond are dropped
+
+struct PacerCounters {
+  unsigned int frames;
+  unsigned int updates;
+  unsigned int late;    // Frames that had to run more than one update to catch up
+  unsigned int dropped; // Updates skipped because the loop fell too far behind
+  double worst_wake_ms; // Jitter, the latest an on time frame started after its deadline
+};
+
+// Fixed timestep scheduling like pico8's _update (30 Hz) and _update60. Frames are only
+// drawn after an update, there's no interpolation between them.
+struct Pacer {
+  unsigned int rate; // Updates per second
+  uint64_t frequency;
+  uint64_t step; // Ticks per update
+  uint64_t next; // When the next update is due
+  PacerCounters counters;
+};
+
+bool pacer_init(Pacer* pacer, unsigned int rate);
+unsigned int pacer_wait(Pacer* pacer); // Waits for the next step, returns the updates to run
+void pacer_reset(Pacer* pacer);        // Starts over from now, after a pause or a long load
+
+#endif // PACER_H
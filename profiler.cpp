@@ -0,0 +1,224 @@
+#include "profiler.h"
+
+#include <SDL_timer.h>
+#include <algorithm>
+#include <epoxy/gl.h>
+#include <stdint.h>
+#include <string.h>
+
+#define VOX_PROFILER_DEPTH 8
+
+struct Profiler {
+  bool enabled;
+  bool has_queries;
+  bool in_frame;
+  uint64_t frame_start;
+  uint64_t phase_ticks[PROFILER_PHASE_COUNT];
+  ProfilerPhase stack[VOX_PROFILER_DEPTH];
+  unsigned int depth;
+  uint64_t mark; // When the phase on top of the stack last resumed
+  unsigned int flush_depth;
+  bool query_active;
+  unsigned int flushes;
+  unsigned int queries[VOX_PROFILER_LATENCY][VOX_PROFILER_QUERIES];
+  unsigned int query_count[VOX_PROFILER_LATENCY];
+  unsigned int completed; // Frames in the history so far
+  ProfilerFrame frames[VOX_PROFILER_FRAMES];
+};
+
+static Profiler profiler;
+
+static const char* profiler_phase_names[PROFILER_PHASE_COUNT] = {
+  "update", "draw", "flush", "resolve", "swap",
+};
+
+static double profiler_ms(uint64_t ticks) {
+  return 1000.0 * ticks / SDL_GetPerformanceFrequency();
+}
+
+void profiler_enable(bool enabled) {
+  if (!enabled && profiler.query_active) {
+    glEndQuery(GL_TIME_ELAPSED);
+    profiler.query_active = false;
+  }
+
+  if (enabled && !profiler.has_queries) {
+    glGenQueries(VOX_PROFILER_LATENCY * VOX_PROFILER_QUERIES, profiler.queries[0]);
+    profiler.has_queries = true;
+  }
+
+  profiler.enabled = enabled;
+  profiler.in_frame = false;
+  profiler.depth = 0;
+  profiler.flush_depth = 0;
+}
+
+bool profiler_enabled() { return profiler.enabled; }
+
+// Polls the queries of the frame that used this slot, if they aren't done they're dropped
+// rather than waited for
+static void profiler_read_queries(unsigned int slot, unsigned int frame) {
+  unsigned int count = profiler.query_count[slot];
+  profiler.query_count[slot] = 0;
+  if (count == 0) {
+    return;
+  }
+
+  GLint available = 0;
+  glGetQueryObjectiv(profiler.queries[slot][count - 1], GL_QUERY_RESULT_AVAILABLE, &available);
+  if (!available) {
+    return;
+  }
+
+  uint64_t ns = 0;
+  for (unsigned int i = 0; i < count; ++i) {
+    GLuint64 elapsed;
+    glGetQueryObjectui64v(profiler.queries[slot][i], GL_QUERY_RESULT, &elapsed);
+    ns += elapsed;
+  }
+
+  ProfilerFrame* f = &profiler.frames[frame % VOX_PROFILER_FRAMES];
+  f->gpu = ns / 1e6;
+  f->gpu_ready = true;
+}
+
+void profiler_begin_frame() {
+  if (!profiler.enabled) {
+    return;
+  }
+
+  uint64_t now = SDL_GetPerformanceCounter();
+
+  if (profiler.in_frame) {
+    ProfilerFrame* f = &profiler.frames[profiler.completed % VOX_PROFILER_FRAMES];
+    for (int i = 0; i < PROFILER_PHASE_COUNT; ++i) {
+      f->phases[i] = profiler_ms(profiler.phase_ticks[i]);
+    }
+    f->total = profiler_ms(now - profiler.frame_start);
+    f->gpu = 0.0;
+    f->flushes = profiler.flushes;
+    f->gpu_ready = false;
+    ++profiler.completed;
+  }
+
+  // The slot this frame's queries go into was last used VOX_PROFILER_LATENCY frames ago
+  unsigned int slot = profiler.completed % VOX_PROFILER_LATENCY;
+  if (profiler.completed >= VOX_PROFILER_LATENCY) {
+    profiler_read_queries(slot, profiler.completed - VOX_PROFILER_LATENCY);
+  } else {
+    profiler.query_count[slot] = 0;
+  }
+
+  memset(profiler.phase_ticks, 0, sizeof(profiler.phase_ticks));
+  profiler.flushes = 0;
+  profiler.frame_start = now;
+  profiler.mark = now;
+  profiler.in_frame = true;
+}
+
+void profiler_begin(ProfilerPhase phase) {
+  if (!profiler.enabled) {
+    return;
+  }
+
+  uint64_t now = SDL_GetPerformanceCounter();
+  if (profiler.depth > 0) {
+    profiler.phase_ticks[profiler.stack[profiler.depth - 1]] += now - profiler.mark;
+  }
+  if (profiler.depth < VOX_PROFILER_DEPTH) {
+    profiler.stack[profiler.depth] = phase;
+  }
+  ++profiler.depth;
+  profiler.mark = now;
+}
+
+void profiler_end() {
+  if (!profiler.enabled || profiler.depth == 0) {
+    return;
+  }
+
+  uint64_t now = SDL_GetPerformanceCounter();
+  unsigned int top = std::min(profiler.depth, static_cast<unsigned int>(VOX_PROFILER_DEPTH));
+  profiler.phase_ticks[profiler.stack[top - 1]] += now - profiler.mark;
+  --profiler.depth;
+  profiler.mark = now;
+}
+
+void profiler_begin_flush() {
+  if (!profiler.enabled) {
+    return;
+  }
+
+  profiler_begin(PROFILER_FLUSH);
+  if (profiler.flush_depth++ > 0) {
+    return;
+  }
+
+  ++profiler.flushes;
+  unsigned int slot = profiler.completed % VOX_PROFILER_LATENCY;
+  if (profiler.in_frame && profiler.query_count[slot] < VOX_PROFILER_QUERIES) {
+    glBeginQuery(GL_TIME_ELAPSED, profiler.queries[slot][profiler.query_count[slot]]);
+    profiler.query_active = true;
+  }
+}
+
+void profiler_end_flush() {
+  if (!profiler.enabled || profiler.flush_depth == 0) {
+    return;
+  }
+
+  if (--profiler.flush_depth == 0 && profiler.query_active) {
+    glEndQuery(GL_TIME_ELAPSED);
+    profiler.query_active = false;
+    ++profiler.query_count[profiler.completed % VOX_PROFILER_LATENCY];
+  }
+  profiler_end();
+}
+
+const ProfilerFrame* profiler_frame(unsigned int ago) {
+  if (ago >= profiler.completed || ago >= VOX_PROFILER_FRAMES) {
+    return nullptr;
+  }
+  return &profiler.frames[(profiler.completed - 1 - ago) % VOX_PROFILER_FRAMES];
+}
+
+bool profiler_average(ProfilerFrame* average, unsigned int frames) {
+  memset(average, 0, sizeof(*average));
+
+  unsigned int count = 0;
+  unsigned int gpu_count = 0;
+  for (unsigned int i = 0; i < frames; ++i) {
+    const ProfilerFrame* f = profiler_frame(i);
+    if (!f) {
+      break;
+    }
+
+    for (int j = 0; j < PROFILER_PHASE_COUNT; ++j) {
+      average->phases[j] += f->phases[j];
+    }
+    average->total += f->total;
+    average->flushes += f->flushes;
+    if (f->gpu_ready) {
+      average->gpu += f->gpu;
+      ++gpu_count;
+    }
+    ++count;
+  }
+
+  if (count == 0) {
+    return false;
+  }
+
+  for (int j = 0; j < PROFILER_PHASE_COUNT; ++j) {
+    average->phases[j] /= count;
+  }
+  average->total /= count;
+  average->flushes /= count;
+  if (gpu_count > 0) {
+    average->gpu /= gpu_count;
+    average->gpu_ready = true;
+  }
+  return true;
+}
+
+const char* profiler_phase_name(ProfilerPhase phase) { return profiler_phase_names[phase]; }
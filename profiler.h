@@ -0,0 +1,47 @@
+#ifndef PROFILER_H
+#define PROFILER_H
+
+#define VOX_PROFILER_FRAMES 120  // Completed frames kept in the history
+#define VOX_PROFILER_LATENCY 4   // Frames before the GPU timings are read back
+#define VOX_PROFILER_QUERIES 128 // Flushes timed on the GPU per frame, later ones aren't
+
+enum ProfilerPhase {
+  PROFILER_UPDATE,
+  PROFILER_DRAW,
+  PROFILER_FLUSH,
+  PROFILER_RESOLVE,
+  PROFILER_SWAP,
+  PROFILER_PHASE_COUNT,
+};
+
+// Timings of one frame in milliseconds. A phase doesn't include the phases nested in it, so a
+// flush in the middle of draw() only counts as flush.
+struct ProfilerFrame {
+  double phases[PROFILER_PHASE_COUNT];
+  double total; // From the start of this frame to the start of the next one
+  double gpu;   // Sum of the timed flushes
+  unsigned int flushes;
+  bool gpu_ready; // The queries have been read back
+};
+
+// Times the phases of each frame on the CPU and each flush on the GPU, sprites_flush() and the
+// batches drawn outside of it. Only the thread owning the GL context calls these, they do
+// nothing until enabled.
+void profiler_enable(bool enabled);
+bool profiler_enabled();
+void profiler_begin_frame(); // Ends the previous frame
+void profiler_begin(ProfilerPhase phase);
+void profiler_end();
+void profiler_begin_flush(); // Nested flushes are timed as part of the outer one
+void profiler_end_flush();
+
+const ProfilerFrame* profiler_frame(unsigned int ago); // 0 is the last completed frame
+bool profiler_average(ProfilerFrame* average, unsigned int frames); // Over the last frames
+const char* profiler_phase_name(ProfilerPhase phase);
+
+struct ProfilerScope {
+  ProfilerScope(ProfilerPhase phase) { profiler_begin(phase); }
+  ~ProfilerScope() { profiler_end(); }
+};
+
+#endif // PROFILER_H
@@ -0,0 +1,204 @@
+#include "quantize.h"
+
+#include "color.h"
+#include "trace.h"
+
+#include <SDL_log.h>
+#include <mutex>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define VOX_QUANTIZE_X86
+#endif
+
+#define VOX_QUANTIZE_CELL (256 / VOX_QUANTIZE_CELLS) // Channel values per cell
+#define VOX_QUANTIZE_ENDS (2 * VOX_QUANTIZE_CELLS)   // First and last value of every cell
+
+// Returns the entries or'ed together so rows without mixed or pending cells skip the fixing up
+typedef uint8_t (*QuantizeRow)(const uint8_t* rgba, uint8_t* out, int count);
+
+static std::mutex quantize_mutex;
+static bool quantize_built;
+static Color quantize_palette[16]; // What the table was built for
+static QuantizeRow quantize_row;
+static double quantize_red[16][VOX_QUANTIZE_ENDS];
+static double quantize_green[16][VOX_QUANTIZE_ENDS];
+static double quantize_blue[16][VOX_QUANTIZE_ENDS];
+// Padded so 32-bit gathers at the last entry stay inside
+alignas(64) static uint8_t quantize_table[VOX_QUANTIZE_SIZE + 3];
+
+static int quantize_key(const uint8_t* p) {
+  const int shift = 8 - VOX_QUANTIZE_BITS;
+  return ((p[0] >> shift) << (2 * VOX_QUANTIZE_BITS)) | ((p[1] >> shift) << VOX_QUANTIZE_BITS) |
+         (p[2] >> shift);
+}
+
+// Squared weighted distances along one channel to every color at both ends of every cell,
+// the same terms color_distance() sums so comparing their sums gives the same closest color
+static void quantize_channel(double terms[16][VOX_QUANTIZE_ENDS], int channel, double weight) {
+  for (int i = 0; i < 16; ++i) {
+    // color_find_closest() measures color 0 as black whatever the palette says
+    const uint8_t* c = &color_palette[i].r;
+    int p = i == 0 ? 0 : c[channel];
+    for (int end = 0; end < VOX_QUANTIZE_ENDS; ++end) {
+      int v = (end / 2) * VOX_QUANTIZE_CELL + (end % 2) * (VOX_QUANTIZE_CELL - 1);
+      double d = static_cast<double>(v - p) * weight;
+      terms[i][end] = d * d;
+    }
+  }
+}
+
+// Only the cells images actually hit are worked out, a new palette just clears the table
+static void quantize_reset() {
+  TRACE("quantize_reset");
+  quantize_channel(quantize_red, 0, 0.30);
+  quantize_channel(quantize_green, 1, 0.59);
+  quantize_channel(quantize_blue, 2, 0.11);
+  memset(quantize_table, VOX_QUANTIZE_PENDING, VOX_QUANTIZE_SIZE);
+  memcpy(quantize_palette, color_palette, sizeof(quantize_palette));
+  quantize_built = true;
+}
+
+// Cells are convex and so are the regions where a color is the closest, a cell whose eight
+// corners agree lies entirely in one
+static uint8_t quantize_cell(int key) {
+  int r = key >> (2 * VOX_QUANTIZE_BITS);
+  int g = (key >> VOX_QUANTIZE_BITS) & (VOX_QUANTIZE_CELLS - 1);
+  int b = key & (VOX_QUANTIZE_CELLS - 1);
+
+  int cell = -1;
+  for (int corner = 0; corner < 8; ++corner) {
+    int red = r * 2 + (corner >> 2);
+    int green = g * 2 + ((corner >> 1) & 1);
+    int blue = b * 2 + (corner & 1);
+    int c = 0;
+    double min_dist = quantize_red[0][red] + quantize_green[0][green] + quantize_blue[0][blue];
+    for (int i = 1; i < 16; ++i) {
+      double dist = quantize_red[i][red] + quantize_green[i][green] + quantize_blue[i][blue];
+      if (dist < min_dist) {
+        c = i;
+        min_dist = dist;
+      }
+    }
+    if (cell >= 0 && c != cell) {
+      return VOX_QUANTIZE_MIXED;
+    }
+    cell = c;
+  }
+  return cell;
+}
+
+static uint8_t quantize_row_scalar(const uint8_t* rgba, uint8_t* out, int count) {
+  uint8_t flags = 0;
+  for (int i = 0; i < count; ++i) {
+    out[i] = quantize_table[quantize_key(rgba + i * 4)];
+    flags |= out[i];
+  }
+  return flags;
+}
+
+#ifdef VOX_QUANTIZE_X86
+#if VOX_QUANTIZE_BITS != 6
+#error The SIMD keys assume 6 bits per channel
+#endif
+
+// Keys of four RGBA pixels, the top 6 bits of each channel end up next to each other
+__attribute__((target("sse4.1"))) static inline __m128i quantize_keys_sse(__m128i p) {
+  __m128i mask = _mm_set1_epi32(0xFC);
+  __m128i r = _mm_slli_epi32(_mm_and_si128(p, mask), 10);
+  __m128i g = _mm_slli_epi32(_mm_and_si128(_mm_srli_epi32(p, 8), mask), 4);
+  __m128i b = _mm_srli_epi32(_mm_and_si128(_mm_srli_epi32(p, 16), mask), 2);
+  return _mm_or_si128(_mm_or_si128(r, g), b);
+}
+
+__attribute__((target("sse4.1"))) static uint8_t quantize_row_sse41(const uint8_t* rgba,
+                                                                      uint8_t* out, int count) {
+  uint8_t flags = 0;
+  int i = 0;
+  for (; i + 4 <= count; i += 4) {
+    __m128i keys = quantize_keys_sse(_mm_loadu_si128(reinterpret_cast<const __m128i*>(rgba)));
+    out[i] = quantize_table[_mm_extract_epi32(keys, 0)];
+    out[i + 1] = quantize_table[_mm_extract_epi32(keys, 1)];
+    out[i + 2] = quantize_table[_mm_extract_epi32(keys, 2)];
+    out[i + 3] = quantize_table[_mm_extract_epi32(keys, 3)];
+    flags |= out[i] | out[i + 1] | out[i + 2] | out[i + 3];
+    rgba += 16;
+  }
+  return flags | quantize_row_scalar(rgba, out + i, count - i);
+}
+
+__attribute__((target("avx2"))) static uint8_t quantize_row_avx2(const uint8_t* rgba,
+                                                                   uint8_t* out, int count) {
+  const __m256i mask = _mm256_set1_epi32(0xFC);
+  // The low byte of every entry gathered, in the first four bytes of each half
+  const __m256i low_bytes =
+    _mm256_setr_epi8(0, 4, 8, 12, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 0, 4, 8, 12,
+                     -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1);
+  const int* table = reinterpret_cast<const int*>(quantize_table);
+  __m256i flags = _mm256_setzero_si256();
+  int i = 0;
+  for (; i + 8 <= count; i += 8) {
+    __m256i p = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(rgba));
+    __m256i r = _mm256_slli_epi32(_mm256_and_si256(p, mask), 10);
+    __m256i g = _mm256_slli_epi32(_mm256_and_si256(_mm256_srli_epi32(p, 8), mask), 4);
+    __m256i b = _mm256_srli_epi32(_mm256_and_si256(_mm256_srli_epi32(p, 16), mask), 2);
+    __m256i keys = _mm256_or_si256(_mm256_or_si256(r, g), b);
+    __m256i entries = _mm256_shuffle_epi8(_mm256_i32gather_epi32(table, keys, 1), low_bytes);
+    flags = _mm256_or_si256(flags, entries);
+    uint32_t low = _mm_cvtsi128_si32(_mm256_castsi256_si128(entries));
+    uint32_t high = _mm_cvtsi128_si32(_mm256_extracti128_si256(entries, 1));
+    memcpy(out + i, &low, 4);
+    memcpy(out + i + 4, &high, 4);
+    rgba += 32;
+  }
+  uint32_t any = _mm256_movemask_epi8(_mm256_slli_epi32(flags, 1)) |
+                 _mm256_movemask_epi8(flags);
+  return (any ? VOX_QUANTIZE_MIXED : 0) | quantize_row_scalar(rgba, out + i, count - i);
+}
+#endif
+
+static QuantizeRow quantize_select_row() {
+#ifdef VOX_QUANTIZE_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) {
+    SDL_LogDebug(SDL_LOG_CATEGORY_APPLICATION, "Quantizer: AVX2 rows");
+    return quantize_row_avx2;
+  }
+  if (__builtin_cpu_supports("sse4.1")) {
+    SDL_LogDebug(SDL_LOG_CATEGORY_APPLICATION, "Quantizer: SSE4.1 rows");
+    return quantize_row_sse41;
+  }
+#endif
+  return quantize_row_scalar;
+}
+
+void quantize_image(const uint8_t* rgba, int stride, int width, int height, uint8_t* out,
+                    int out_stride) {
+  TRACE("quantize_image");
+  std::lock_guard<std::mutex> lock(quantize_mutex);
+  if (!quantize_row) {
+    quantize_row = quantize_select_row();
+  }
+  if (!quantize_built || memcmp(quantize_palette, color_palette, sizeof(quantize_palette)) != 0) {
+    quantize_reset();
+  }
+
+  for (int y = 0; y < height; ++y) {
+    const uint8_t* row = rgba + static_cast<size_t>(y) * stride;
+    uint8_t* indices = out + static_cast<size_t>(y) * out_stride;
+    if (!(quantize_row(row, indices, width) & (VOX_QUANTIZE_MIXED | VOX_QUANTIZE_PENDING))) {
+      continue;
+    }
+    for (int x = 0; x < width; ++x) {
+      if (indices[x] & (VOX_QUANTIZE_MIXED | VOX_QUANTIZE_PENDING)) {
+        const uint8_t* p = row + x * 4;
+        uint8_t* entry = &quantize_table[quantize_key(p)];
+        if (*entry == VOX_QUANTIZE_PENDING) {
+          *entry = quantize_cell(quantize_key(p));
+        }
+        indices[x] = *entry == VOX_QUANTIZE_MIXED ? color_find_closest(p[0], p[1], p[2]) : *entry;
+      }
+    }
+  }
+}
@@ -0,0 +1,21 @@
+#ifndef QUANTIZE_H
+#define QUANTIZE_H
+
+#include <stdint.h>
+
+// RGB to palette index through a table with VOX_QUANTIZE_BITS per channel. Cells whose
+// corners all have the same closest color map straight to it, the rest are marked mixed and
+// those pixels go through color_find_closest(). Cells are worked out the first time a pixel
+// falls in them and the table starts over whenever color_palette has changed.
+#define VOX_QUANTIZE_BITS 6
+#define VOX_QUANTIZE_CELLS (1 << VOX_QUANTIZE_BITS)      // Per channel
+#define VOX_QUANTIZE_SIZE (1 << (3 * VOX_QUANTIZE_BITS)) // 256 KiB
+#define VOX_QUANTIZE_MIXED 0x80
+#define VOX_QUANTIZE_PENDING 0x40 // Not worked out yet
+
+// Converts width by height RGBA pixels with rows stride bytes apart into indices with rows
+// out_stride apart, the same as color_find_closest() for every pixel
+void quantize_image(const uint8_t* rgba, int stride, int width, int height, uint8_t* out,
+                    int out_stride);
+
+#endif // QUANTIZE_H
@@ -1,8 +1,14 @@
 #include "screen.hpp"
 
+#include "glstate.h"
+#include "shader.h"
 #include "vox.h"
 
+#include <SDL_log.h>
 #include <algorithm>
+#include <epoxy/gl.h>
+#include <glm/gtc/type_ptr.hpp>
+#include <string.h>
 
 SDL_Rect screen_calc_rect(int width, int height) {
   int w = 1;
@@ -24,3 +30,75 @@ SDL_Rect screen_calc_rect(int width, int height) {
   }
   return { (width - w) / 2, (height - w) / 2, w, w };
 }
+
+bool screen_init(Screen* screen) {
+  glGenTextures(1, &screen->texture);
+  glBindTexture(GL_TEXTURE_2D, screen->texture);
+
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+
+  glTexImage2D(GL_TEXTURE_2D, 0, GL_R8UI, VOX_WIDTH, VOX_WIDTH, 0, GL_RED_INTEGER,
+               GL_UNSIGNED_BYTE, nullptr);
+
+  glGenFramebuffers(1, &screen->fbo);
+  glBindFramebuffer(GL_FRAMEBUFFER, screen->fbo);
+  glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, screen->texture, 0);
+
+  GLenum status = glCheckFramebufferStatus(GL_FRAMEBUFFER);
+  glBindFramebuffer(GL_FRAMEBUFFER, 0);
+
+  if (status != GL_FRAMEBUFFER_COMPLETE) {
+    SDL_LogError(SDL_LOG_CATEGORY_APPLICATION, "Unable to create screen framebuffer: 0x%x",
+                 status);
+    return false;
+  }
+
+  // The resolve pass is a single fullscreen triangle generated from gl_VertexID
+  glGenVertexArrays(1, &screen->vao);
+
+  screen->shader = shader_load("screen");
+  if (screen->shader == VOX_ERROR) {
+    return false;
+  }
+
+  glUseProgram(screen->shader);
+  glUniform3fv(shader_uniform(screen->shader, "palette"), 16, glm::value_ptr(shader_palette[0]));
+  glUniform1i(shader_uniform(screen->shader, "Screen"), 0);
+  screen->screen_map_location = shader_uniform(screen->shader, "screenMap");
+
+  for (int i = 0; i < 16; ++i) {
+    screen->screen_map[i] = i;
+  }
+  memset(screen->uploaded_screen_map, 0xFF, sizeof(screen->uploaded_screen_map));
+
+  glstate_reset();
+
+  return true;
+}
+
+void screen_begin(Screen* screen) {
+  glBindFramebuffer(GL_FRAMEBUFFER, screen->fbo);
+  glViewport(0, 0, VOX_WIDTH, VOX_WIDTH);
+}
+
+void screen_clear(Screen* screen, int c) {
+  GLuint index = static_cast<GLuint>(c & 0x0F);
+  glClearBufferuiv(GL_COLOR, 0, &index);
+}
+
+void screen_resolve(Screen* screen, const SDL_Rect& rect, unsigned int framebuffer) {
+  glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+  glViewport(rect.x, rect.y, rect.w, rect.h);
+
+  glstate_use_program(screen->shader);
+
+  if (memcmp(screen->screen_map, screen->uploaded_screen_map, sizeof(screen->screen_map)) != 0) {
+    memcpy(screen->uploaded_screen_map, screen->screen_map, sizeof(screen->screen_map));
+    glUniform1iv(screen->screen_map_location, 16, screen->screen_map);
+  }
+
+  glstate_bind_texture(0, GL_TEXTURE_2D, screen->texture);
+  glstate_bind_vertex_array(screen->vao);
+  glDrawArrays(GL_TRIANGLES, 0, 3);
+}
@@ -0,0 +1,15 @@
+#version 330 core
+out vec4 FragColor;
+
+in vec2 TexCoord;
+
+// Color indices written by the sprite pass
+uniform usampler2D Screen;
+
+uniform vec3 palette[16];
+uniform int screenMap[16];
+
+void main() {
+  uint index = texture(Screen, TexCoord).r;
+  FragColor = vec4(palette[screenMap[index & 0x0Fu]], 1.0);
+}
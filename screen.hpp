@@ -2,7 +2,25 @@
 #define SCREEN_HPP
 
 #include <SDL_rect.h>
+#include <stdint.h>
+
+// The VOX_WIDTH x VOX_WIDTH color index framebuffer that everything is drawn into
+// before being resolved to the window in a single pass
+struct Screen {
+  unsigned int fbo;
+  unsigned int texture;
+  unsigned int shader;
+  unsigned int vao;
+  int screen_map_location;
+  int screen_map[16]; // Screen palette, maps drawn colors to displayed colors
+  int uploaded_screen_map[16];
+};
 
 SDL_Rect screen_calc_rect(int width, int height);
 
+bool screen_init(Screen* screen);
+void screen_begin(Screen* screen);
+void screen_clear(Screen* screen, int c);
+void screen_resolve(Screen* screen, const SDL_Rect& rect, unsigned int framebuffer = 0);
+
 #endif // SCREEN_HPP
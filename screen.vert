@@ -0,0 +1,10 @@
+#version 330 core
+
+out vec2 TexCoord;
+
+void main() {
+  // Covers the viewport with a single triangle: (0, 0), (2, 0), (0, 2) in texture space
+  vec2 uv = vec2(float((gl_VertexID << 1) & 2), float(gl_VertexID & 2));
+  gl_Position = vec4(uv * 2.0 - 1.0, 0.0, 1.0);
+  TexCoord = uv;
+}
@@ -1,6 +1,7 @@
 #include "shader.h"
 
 #include "color.h"
+#include "trace.h"
 #include "vox.h"
 
 #include <SDL_log.h>
@@ -8,6 +9,7 @@
 #include <fstream>
 #include <glm/gtc/matrix_transform.hpp>
 #include <string>
+#include <vector>
 
 const glm::mat4 shader_proj = glm::ortho(0.0f, 128.0f, 128.0f, 0.0f, 0.0f, 1.0f);
 
@@ -30,14 +32,22 @@ const glm::vec3 shader_palette[] = {
   glm::vec3(color_palette[15].r / 256.0, color_palette[15].g / 256.0, color_palette[15].b / 256.0),
 };
 
-int shader_alpha_map[] = {
+thread_local int shader_alpha_map[] = {
   1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
 };
 
-int shader_color_map[] = {
+thread_local int shader_color_map[] = {
   0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15,
 };
 
+struct ShaderUniform {
+  unsigned int shader;
+  std::string name;
+  int location;
+};
+
+static std::vector<ShaderUniform> shader_uniforms;
+
 std::string read_content(const std::string& filename) {
   std::ifstream f(filename);
   std::string str;
@@ -72,14 +82,58 @@ bool compile_shader(unsigned int id, const std::string& source) {
   return true;
 }
 
-unsigned int shader_load(const char* name) {
+void cache_uniforms(unsigned int shader) {
+  int count;
+  glGetProgramiv(shader, GL_ACTIVE_UNIFORMS, &count);
+
+  for (int i = 0; i < count; ++i) {
+    char name[256];
+    int size;
+    GLenum type;
+    glGetActiveUniform(shader, i, sizeof(name), nullptr, &size, &type, name);
+
+    ShaderUniform uniform;
+    uniform.shader = shader;
+    uniform.name = name;
+    uniform.location = glGetUniformLocation(shader, name);
+
+    // Arrays are reported as "name[0]", they're looked up without the subscript
+    size_t subscript = uniform.name.find('[');
+    if (subscript != std::string::npos) {
+      uniform.name.erase(subscript);
+    }
+
+    shader_uniforms.push_back(uniform);
+  }
+}
+
+std::string add_defines(const std::string& source, const char* defines) {
+  if (!defines) {
+    return source;
+  }
+
+  // Defines have to come after the #version line
+  size_t pos = source.find('\n');
+  if (pos == std::string::npos) {
+    return source;
+  }
+
+  std::string result(source, 0, pos + 1);
+  result.append(defines);
+  result.append("\n");
+  result.append(source, pos + 1, std::string::npos);
+  return result;
+}
+
+unsigned int shader_load(const char* name, const char* defines) {
+  TRACE_GL("shader_load");
   unsigned int shader;
 
   unsigned int vertex_shader;
   vertex_shader = glCreateShader(GL_VERTEX_SHADER);
   std::string vertex_shader_file(name);
   vertex_shader_file.append(".vert");
-  if (!compile_shader(vertex_shader, read_content(vertex_shader_file))) {
+  if (!compile_shader(vertex_shader, add_defines(read_content(vertex_shader_file), defines))) {
     return VOX_ERROR;
   }
 
@@ -87,7 +141,8 @@ unsigned int shader_load(const char* name) {
   fragment_shader = glCreateShader(GL_FRAGMENT_SHADER);
   std::string fragment_shader_file(name);
   fragment_shader_file.append(".frag");
-  if (!compile_shader(fragment_shader, read_content(fragment_shader_file))) {
+  if (!compile_shader(fragment_shader,
+                      add_defines(read_content(fragment_shader_file), defines))) {
     return VOX_ERROR;
   }
 
@@ -105,5 +160,17 @@ unsigned int shader_load(const char* name) {
     return VOX_ERROR;
   }
 
+  cache_uniforms(shader);
+
   return shader;
 }
+
+int shader_uniform(unsigned int shader, const char* name) {
+  for (size_t i = 0; i < shader_uniforms.size(); ++i) {
+    const ShaderUniform& uniform = shader_uniforms[i];
+    if (uniform.shader == shader && uniform.name == name) {
+      return uniform.location;
+    }
+  }
+  return -1;
+}
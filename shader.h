@@ -3,14 +3,18 @@
 
 #include <glm/glm.hpp>
 
-unsigned int shader_load(const char* name);
+// Defines are inserted after the #version line, e.g. "#define FOO\n#define BAR"
+unsigned int shader_load(const char* name, const char* defines = nullptr);
+
+int shader_uniform(unsigned int shader, const char* name);
 
 extern const glm::mat4 shader_proj;
 
 extern const glm::vec3 shader_palette[16];
 
-extern int shader_alpha_map[16];
+// Per thread so draws can be recorded in parallel, each thread starts out with the defaults
+extern thread_local int shader_alpha_map[16];
 
-extern int shader_color_map[16];
+extern thread_local int shader_color_map[16];
 
 #endif // SHADER_H
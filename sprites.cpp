@@ -1,24 +1,39 @@
 #include "sprites.h"
 
+#include "glstate.h"
 #include "image.h"
+#include "map.h"
+#include "profiler.h"
 #include "shader.h"
+#include "trace.h"
 #include "vox.h"
 
+#include <SDL_log.h>
+#include <algorithm>
 #include <epoxy/gl.h>
 #include <glm/gtc/type_ptr.hpp>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
 
-bool sprites_load_texture(Sprites* sprites, const char* filename, bool is_system_sprites = false) {
-  if (!sprites->texture) {
-    glGenTextures(1, &sprites->texture);
-    glBindTexture(GL_TEXTURE_2D, sprites->texture);
+static void sprites_create_texture(Sprites* sprites) {
+  glGenTextures(1, &sprites->texture);
+  glBindTexture(GL_TEXTURE_2D_ARRAY, sprites->texture);
 
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+  glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, GL_REPEAT);
+  glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, GL_REPEAT);
+  glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+  glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
 
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_R8UI, VOX_SPRITES_WIDTH, 2 * VOX_SPRITES_WIDTH, 0,
-                 GL_RED_INTEGER, GL_UNSIGNED_BYTE, nullptr);
+  glTexImage3D(GL_TEXTURE_2D_ARRAY, 0, GL_R8UI, VOX_SPRITES_WIDTH, VOX_SPRITES_WIDTH,
+               VOX_SPRITE_BANKS, 0, GL_RED_INTEGER, GL_UNSIGNED_BYTE, nullptr);
+}
+
+bool sprites_load_bank(Sprites* sprites, unsigned int bank, const char* filename) {
+  TRACE_GL("sprites_load_bank");
+  if (bank >= VOX_SPRITE_BANKS) {
+    SDL_LogError(SDL_LOG_CATEGORY_APPLICATION, "There is no sprite bank %u", bank);
+    return false;
   }
 
   uint8_t* data = image_load(filename);
@@ -27,23 +42,76 @@ bool sprites_load_texture(Sprites* sprites, const char* filename, bool is_system
     return false;
   }
 
-  int offset = is_system_sprites ? 0 : VOX_SPRITES_WIDTH;
-  glTexSubImage2D(GL_TEXTURE_2D, 0, 0, offset, VOX_SPRITES_WIDTH, VOX_SPRITES_WIDTH, GL_RED_INTEGER,
-                  GL_UNSIGNED_BYTE, data);
+  // Draws already batched still show what the bank held before
+  if (sprites->batch_count > 0 || !sprites->commands.commands.empty()) {
+    sprites_flush(sprites);
+  }
+  glstate_bind_texture(0, GL_TEXTURE_2D_ARRAY, sprites->texture);
+  glTexSubImage3D(GL_TEXTURE_2D_ARRAY, 0, 0, 0, bank, VOX_SPRITES_WIDTH, VOX_SPRITES_WIDTH, 1,
+                  GL_RED_INTEGER, GL_UNSIGNED_BYTE, data);
 
   delete[] data;
 
   return true;
 }
 
+static thread_local SpritesRecorder* sprites_recorder = nullptr;
+static thread_local int sprites_saved_color_map[16]; // The thread's palette while recording
+static thread_local int sprites_saved_alpha_map[16];
+
+static const char* sprites_format_defines[VOX_FORMAT_COUNT] = {
+  "#define VOX_FORMAT_COMPACT\n",
+  "#define VOX_FORMAT_STANDARD\n",
+  "#define VOX_FORMAT_WIDE\n",
+};
+
+static const unsigned int sprites_format_words[VOX_FORMAT_COUNT] = {1, 3, 4};
+
 bool sprites_load_shader(Sprites* sprites) {
-  sprites->shader = shader_load("sprites");
-  return sprites->shader != VOX_ERROR;
+  std::string defines;
+  if (sprites->flags & VOX_SPRITES_INDEXED) defines.append("#define VOX_INDEXED\n");
+  if (sprites->flags & VOX_SPRITES_VERTEX_PULLING) defines.append("#define VOX_VERTEX_PULLING\n");
+
+  for (int format = 0; format < VOX_FORMAT_COUNT; ++format) {
+    std::string format_defines = defines + sprites_format_defines[format];
+    unsigned int shader = shader_load("sprites", format_defines.c_str());
+    if (shader == VOX_ERROR) {
+      return false;
+    }
+
+    // None of the uniforms change so they're only uploaded once
+    glUseProgram(shader);
+    glUniformMatrix4fv(shader_uniform(shader, "proj"), 1, GL_FALSE, glm::value_ptr(shader_proj));
+    glUniform3fv(shader_uniform(shader, "palette"), 16, glm::value_ptr(shader_palette[0]));
+    glUniform1i(shader_uniform(shader, "Texture"), 0);
+    glUniform1i(shader_uniform(shader, "PaletteStates"), 1);
+    glUniform1i(shader_uniform(shader, "Instances"), 2);
+    glUniform1i(shader_uniform(shader, "Map"), 3);
+    glUniform1i(shader_uniform(shader, "SpriteFlags"), 4);
+
+    sprites->shaders[format] = shader;
+    sprites->instance_base_locations[format] = shader_uniform(shader, "instanceBase");
+  }
+
+  return true;
 }
 
-bool sprites_init(Sprites* sprites) {
-  sprites->batch_count = 0;
+void sprites_create_palette_texture(Sprites* sprites) {
+  glGenTextures(1, &sprites->palette_texture);
+  glBindTexture(GL_TEXTURE_2D, sprites->palette_texture);
 
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+
+  glTexImage2D(GL_TEXTURE_2D, 0, GL_R8UI, 16, VOX_PALETTE_STATES, 0, GL_RED_INTEGER,
+               GL_UNSIGNED_BYTE, nullptr);
+
+  sprites->state = VOX_ERROR;
+  sprites->state_count = 0;
+  sprites->state_uploaded = 0;
+}
+
+static void sprites_create_vertex_attributes(Sprites* sprites) {
   float vertices[] = {
     1.f, 1.f, 0.0f, 1.0f, 1.0f, // top right
     1.f, 0.f, 0.0f, 1.0f, 0.0f, // bottom right
@@ -56,9 +124,6 @@ bool sprites_init(Sprites* sprites) {
     1, 2, 3  // second triangle
   };
 
-  glGenVertexArrays(1, &sprites->vao);
-  glGenBuffers(1, &sprites->instance_vbo);
-
   unsigned int vbo;
   glGenBuffers(1, &vbo);
 
@@ -84,11 +149,7 @@ bool sprites_init(Sprites* sprites) {
   }
 
   {
-    glBindBuffer(GL_ARRAY_BUFFER, sprites->instance_vbo);
-    glBufferData(GL_ARRAY_BUFFER, sizeof(glm::uvec2) * VOX_MAX_SPRITE_BATCH, nullptr,
-                 GL_DYNAMIC_DRAW);
-
-    glVertexAttribIPointer(2, 2, GL_UNSIGNED_INT, 2 * sizeof(GLuint), (void*)0);
+    glBindBuffer(GL_ARRAY_BUFFER, sprites->stream.buffer);
     glEnableVertexAttribArray(2);
 
     glBindBuffer(GL_ARRAY_BUFFER, 0);
@@ -96,57 +157,663 @@ bool sprites_init(Sprites* sprites) {
   }
 
   glBindVertexArray(0);
+}
+
+static bool sprites_create_instance_texture(Sprites* sprites) {
+  // The instance texture covers the whole stream buffer, only GL_MAX_TEXTURE_BUFFER_SIZE
+  // texels are guaranteed to be addressable.
+  int max_texels;
+  glGetIntegerv(GL_MAX_TEXTURE_BUFFER_SIZE, &max_texels);
+
+  size_t texels = sprites->stream.region_size * sprites->stream.region_count / sizeof(GLuint);
+  if (texels > static_cast<size_t>(max_texels)) {
+    SDL_LogWarn(SDL_LOG_CATEGORY_APPLICATION,
+                "Stream buffer exceeds GL_MAX_TEXTURE_BUFFER_SIZE (%d), using vertex attributes",
+                max_texels);
+    return false;
+  }
 
-  return sprites_load_texture(sprites, "pico8_font.png", true) &&
-         sprites_load_texture(sprites, "sprites1.png") && sprites_load_shader(sprites);
+  glGenTextures(1, &sprites->instance_texture);
+  glBindTexture(GL_TEXTURE_BUFFER, sprites->instance_texture);
+  glTexBuffer(GL_TEXTURE_BUFFER, GL_R32UI, sprites->stream.buffer);
+  glBindTexture(GL_TEXTURE_BUFFER, 0);
+
+  return true;
+}
+
+static void sprites_begin_batch(Sprites* sprites) {
+  Stream* stream = &sprites->stream;
+  sprites->batch = reinterpret_cast<uint32_t*>(stream->data + stream->head);
+  sprites->batch_count = 0;
+  sprites->batch_format = VOX_FORMAT_COMPACT;
+  sprites->batch_capacity = stream->region_size - stream->head;
+}
+
+bool sprites_init(Sprites* sprites, unsigned int flags) {
+  sprites->flags = flags;
+  memset(&sprites->frame, 0, sizeof(sprites->frame));
+  memset(&sprites->last, 0, sizeof(sprites->last));
+  command_buffer_init(&sprites->commands);
+  sprites->layer = 0;
+  sprites->map = nullptr;
+  sprites->map_pending = false;
+
+  if (!stream_init(&sprites->stream, 3 * sizeof(uint32_t) * VOX_SPRITE_REGION_INSTANCES,
+                   VOX_SPRITE_STREAM_REGIONS)) {
+    return false;
+  }
+  sprites_begin_batch(sprites);
+
+  glGenVertexArrays(1, &sprites->vao);
+
+  if (sprites->flags & VOX_SPRITES_VERTEX_PULLING) {
+    if (!sprites_create_instance_texture(sprites)) {
+      sprites->flags &= ~VOX_SPRITES_VERTEX_PULLING;
+    }
+  }
+
+  if (!(sprites->flags & VOX_SPRITES_VERTEX_PULLING)) {
+    sprites_create_vertex_attributes(sprites);
+  }
+
+  sprites_create_palette_texture(sprites);
+  sprites_create_texture(sprites);
+
+  // Bindings were changed directly while setting up
+  glstate_reset();
+
+  if (!sprites_load_bank(sprites, VOX_BANK_FONT, "pico8_font.png") ||
+      !sprites_load_bank(sprites, VOX_BANK_GAME, "sprites1.png") || !sprites_load_shader(sprites)) {
+    return false;
+  }
+  glstate_reset();
+
+  return true;
 }
 
-void sprites_flush(Sprites* sprites) {
+static const char* sprites_flush_reason_names[SPRITES_FLUSH_REASON_COUNT] = {
+  "explicit", "end_of_frame", "palette", "batch_full", "format", "map",
+};
+
+static void sprites_draw_batch(Sprites* sprites, SpritesFlushReason reason) {
   if (sprites->batch_count > 0) {
-    glBindTexture(GL_TEXTURE_2D, sprites->texture);
-    glUseProgram(sprites->shader);
+    // Batches drawn when they're full or change format are timed as flushes of their own
+    profiler_begin_flush();
+    if (sprites->map) {
+      sprites->frame.bytes += map_upload(sprites->map);
+      glstate_bind_texture(3, GL_TEXTURE_2D, sprites->map->texture);
+      glstate_bind_texture(4, GL_TEXTURE_2D, sprites->map->flags_texture);
+    }
+    glstate_bind_texture(0, GL_TEXTURE_2D_ARRAY, sprites->texture);
+    glstate_bind_texture(1, GL_TEXTURE_2D, sprites->palette_texture);
+    unsigned int format = sprites->batch_format;
+    unsigned int words = sprites_format_words[format];
+    glstate_use_program(sprites->shaders[format]);
+
+    if (sprites->state_uploaded < sprites->state_count) {
+      TRACE_GL("palette_upload");
+      glstate_active_texture(1);
+      glTexSubImage2D(GL_TEXTURE_2D, 0, 0, sprites->state_uploaded, 16,
+                      sprites->state_count - sprites->state_uploaded, GL_RED_INTEGER,
+                      GL_UNSIGNED_BYTE, sprites->states[sprites->state_uploaded]);
+      sprites->frame.bytes += 16 * (sprites->state_count - sprites->state_uploaded);
+      sprites->state_uploaded = sprites->state_count;
+    }
+
+    size_t size = words * sizeof(GLuint) * sprites->batch_count;
+    size_t offset = stream_commit(&sprites->stream, size);
+    sprites->frame.bytes += size;
+
+    glstate_bind_vertex_array(sprites->vao);
+
+    if (sprites->flags & VOX_SPRITES_VERTEX_PULLING) {
+      // Six vertices per instance, the shader fetches the instance from the buffer texture
+      glstate_bind_texture(2, GL_TEXTURE_BUFFER, sprites->instance_texture);
+      glUniform1i(sprites->instance_base_locations[format],
+                  static_cast<int>(offset / sizeof(GLuint)));
+      glDrawArrays(GL_TRIANGLES, 0, 6 * sprites->batch_count);
+    } else {
+      glstate_bind_buffer(GL_ARRAY_BUFFER, sprites->stream.buffer);
+      glVertexAttribIPointer(2, words, GL_UNSIGNED_INT, words * sizeof(GLuint), (void*)offset);
+      glDrawElementsInstanced(GL_TRIANGLES, 6, GL_UNSIGNED_INT, 0, sprites->batch_count);
+    }
+
+    ++sprites->frame.draws;
+    ++sprites->frame.reasons[reason];
+    sprites_begin_batch(sprites);
+    profiler_end_flush();
+  }
+
+  // Deferred commands still waiting can hold map() draws too
+  if (sprites->commands.commands.empty()) {
+    sprites->map_pending = false;
+  }
+}
+
+static void sprites_next_region(Sprites* sprites) {
+  sprites_draw_batch(sprites, SPRITES_FLUSH_BATCH_FULL);
+  stream_next_region(&sprites->stream);
+  sprites_begin_batch(sprites);
+}
+
+static void sprites_reset_states(Sprites* sprites) {
+  sprites->state = VOX_ERROR;
+  sprites->state_count = 0;
+  sprites->state_uploaded = 0;
+}
+
+void sprites_end_frame(Sprites* sprites) {
+  sprites_flush(sprites, SPRITES_FLUSH_END_OF_FRAME);
+  sprites_next_region(sprites);
+  sprites_reset_states(sprites);
+
+  sprites->last = sprites->frame;
+  memset(&sprites->frame, 0, sizeof(sprites->frame));
+}
+
+const SpritesCounters* sprites_counters(const Sprites* sprites) { return &sprites->last; }
+
+const char* sprites_flush_reason_name(SpritesFlushReason reason) {
+  return sprites_flush_reason_names[reason];
+}
+
+void sprites_palette_changed(Sprites* sprites) {
+  if (sprites_recorder) {
+    sprites_recorder->state = VOX_ERROR;
+  } else {
+    sprites->state = VOX_ERROR;
+  }
+}
+
+void sprites_layer(Sprites* sprites, int layer) {
+  layer = std::min(std::max(layer, 0), VOX_COMMAND_LAYERS - 1);
+  if (sprites_recorder) {
+    sprites_recorder->layer = layer;
+  } else {
+    sprites->layer = layer;
+  }
+}
+
+void sprites_set_map(Sprites* sprites, Map* map) { sprites->map = map; }
 
-    glUniformMatrix4fv(glGetUniformLocation(sprites->shader, "proj"), 1, GL_FALSE,
-                       glm::value_ptr(shader_proj));
-    glUniform3fv(glGetUniformLocation(sprites->shader, "palette"), 16,
-                 glm::value_ptr(shader_palette[0]));
-    glUniform1iv(glGetUniformLocation(sprites->shader, "colorMap"), 16, shader_color_map);
-    glUniform1iv(glGetUniformLocation(sprites->shader, "alphaMap"), 16, shader_alpha_map);
+void sprites_map_changing(Sprites* sprites) {
+  SpritesRecorder* recorder = sprites_recorder;
+  if (!recorder) {
+    if (sprites->map_pending) {
+      sprites_flush(sprites, SPRITES_FLUSH_MAP);
+    }
+    return;
+  }
+
+  // A map that isn't held is drawn with what it holds when the recording is merged
+  if (recorder->map_pending && sprites->map && sprites->map->held) {
+    map_take_changes(sprites->map, &recorder->map_changes);
+    recorder->map_syncs.push_back({ recorder->commands.size(),
+                                    recorder->map_changes.uploads.size() });
+    recorder->map_pending = false;
+  }
+}
+
+// The counters of whoever is drawing on this thread
+static SpritesCounters* sprites_frame(Sprites* sprites) {
+  return sprites_recorder ? &sprites_recorder->frame : &sprites->frame;
+}
+
+static void sprites_current_entry(uint8_t* entry) {
+  for (int i = 0; i < 16; ++i) {
+    entry[i] = (shader_color_map[i] & 0x0F) | (shader_alpha_map[i] ? 0x10 : 0x00);
+  }
+}
+
+static unsigned int sprites_find_state(Sprites* sprites, const uint8_t* entry) {
+  for (unsigned int i = 0; i < sprites->state_count; ++i) {
+    if (memcmp(sprites->states[i], entry, 16) == 0) {
+      return i;
+    }
+  }
 
-    glBindVertexArray(sprites->vao);
-    glBindBuffer(GL_ARRAY_BUFFER, sprites->instance_vbo);
-    glBufferSubData(GL_ARRAY_BUFFER, 0, sizeof(glm::uvec2) * sprites->batch_count,
-                    &sprites->batch[0]);
-    glDrawElementsInstanced(GL_TRIANGLES, 6, GL_UNSIGNED_INT, 0, sprites->batch_count);
-    glBindVertexArray(0);
-    sprites->batch_count = 0;
+  if (sprites->state_count >= VOX_PALETTE_STATES) {
+    // Every slot is referenced by pending instances so they need to be drawn first
+    sprites_flush(sprites, SPRITES_FLUSH_PALETTE);
+    sprites_reset_states(sprites);
   }
+
+  memcpy(sprites->states[sprites->state_count], entry, 16);
+  return sprites->state_count++;
+}
+
+static void sprites_resolve_state(Sprites* sprites) {
+  uint8_t entry[16];
+  sprites_current_entry(entry);
+  sprites->state = sprites_find_state(sprites, entry);
 }
 
-int clamp(int v) {
-  if (v < -128) return -128;
-  if (v >= 128) return 128;
+static void sprites_recorder_resolve_state(SpritesRecorder* recorder) {
+  uint8_t entry[16];
+  sprites_current_entry(entry);
+
+  unsigned int count = recorder->states.size() / 16;
+  for (unsigned int i = 0; i < count; ++i) {
+    if (memcmp(&recorder->states[i * 16], entry, 16) == 0) {
+      recorder->state = i;
+      return;
+    }
+  }
+
+  recorder->states.insert(recorder->states.end(), entry, entry + 16);
+  recorder->state = count;
+}
+
+// The widest range an instance can hold, anything beyond is clamped
+int sprites_clamp(int v) {
+  if (v < INT16_MIN) return INT16_MIN;
+  if (v > INT16_MAX) return INT16_MAX;
   return v;
 }
 
-void sprites_draw(Sprites* sprites, int sx, int sy, int sw, int sh, int dx, int dy, int dw, int dh,
-                  bool flipx, bool flipy) {
-  if (sprites->batch_count >= VOX_MAX_SPRITE_BATCH) {
-    sprites_flush(sprites);
+static bool sprites_fits_standard(int v) { return v >= -127 && v <= 128; }
+
+// Returns room for an instance of the given format, flushing first when the current batch
+// uses a narrower one. Narrower instances are written in the batch's format instead.
+static uint32_t* sprites_next_instance(Sprites* sprites, unsigned int format) {
+  if (format > sprites->batch_format && sprites->batch_count > 0) {
+    sprites_draw_batch(sprites, SPRITES_FLUSH_FORMAT);
+  }
+
+  if (sprites->batch_count == 0) {
+    sprites->batch_format = format;
+  }
+
+  size_t size = sprites_format_words[sprites->batch_format] * sizeof(uint32_t);
+  if ((sprites->batch_count + 1) * size > sprites->batch_capacity) {
+    // The region is used up so move on to the next one, this only waits if the GPU is
+    // still reading from it.
+    sprites_next_region(sprites);
+    sprites->batch_format = format;
+    size = sprites_format_words[format] * sizeof(uint32_t);
+  }
+
+  return sprites->batch + (sprites->batch_count++ * size / sizeof(uint32_t));
+}
+
+static uint32_t sprites_pack_rect(int x, int y, int w, int h) {
+  return (((uint8_t)(x + 127) & 0xFF) << 24) | (((uint8_t)(y + 127) & 0xFF) << 16) |
+         (((uint8_t)(w + 127) & 0xFF) << 8) | (((uint8_t)(h + 127) & 0xFF) << 0);
+}
+
+static uint32_t sprites_pack_wide(int a, int b) {
+  uint32_t low = static_cast<uint16_t>(sprites_clamp(a));
+  uint32_t high = static_cast<uint16_t>(sprites_clamp(b));
+  return low | (high << 16);
+}
+
+static void sprites_write(Sprites* sprites, const Command& command) {
+  uint32_t* s = sprites_next_instance(sprites, command.format);
+  uint32_t info = command.state | (command.type << 8) | (command.bank << 16);
+
+  switch (sprites->batch_format) {
+    case VOX_FORMAT_COMPACT:
+      s[0] = command.compact | command.state;
+      break;
+    case VOX_FORMAT_STANDARD:
+      s[0] = sprites_pack_rect(command.x, command.y, command.w, command.h);
+      s[1] = command.params;
+      s[2] = info;
+      break;
+    case VOX_FORMAT_WIDE:
+      s[0] = sprites_pack_wide(command.x, command.y);
+      s[1] = sprites_pack_wide(command.w, command.h);
+      s[2] = command.params;
+      s[3] = info;
+      break;
+  }
+}
+
+static unsigned int sprites_format(const Command& command, bool has_compact) {
+  if (has_compact && command.state < VOX_COMPACT_STATES) {
+    return VOX_FORMAT_COMPACT;
+  }
+  if (sprites_fits_standard(command.x) && sprites_fits_standard(command.y) &&
+      sprites_fits_standard(command.w) && sprites_fits_standard(command.h)) {
+    return VOX_FORMAT_STANDARD;
+  }
+  return VOX_FORMAT_WIDE;
+}
+
+static void sprites_add(Sprites* sprites, const Command& command) {
+  sprites->map_pending |= command.type == VOX_INSTANCE_MAP;
+  if (sprites->flags & VOX_SPRITES_DEFERRED) {
+    command_buffer_add(&sprites->commands, command);
+  } else {
+    sprites_write(sprites, command);
+  }
+}
+
+// Adds an instance covering x, y, w, h in the smallest format that holds it. params is the
+// packed texture rectangle or color, compact the compact encoding without the state if the
+// instance has one.
+static void sprites_emit(Sprites* sprites, int x, int y, int w, int h, uint32_t params, int type,
+                         unsigned int bank = 0, bool has_compact = false, uint32_t compact = 0) {
+  Command command;
+  command.x = sprites_clamp(x);
+  command.y = sprites_clamp(y);
+  command.w = sprites_clamp(w);
+  command.h = sprites_clamp(h);
+  command.params = params;
+  command.compact = compact;
+  command.type = type;
+  command.bank = bank;
+
+  if (sprites_recorder) {
+    SpritesRecorder* recorder = sprites_recorder;
+    if (recorder->state == VOX_ERROR) {
+      sprites_recorder_resolve_state(recorder);
+    }
+
+    // The frame's state is only known once merged, until then compact means it could be
+    command.state = recorder->state;
+    command.layer = recorder->layer;
+    command.format = has_compact ? VOX_FORMAT_COMPACT : sprites_format(command, false);
+    recorder->commands.push_back(command);
+    recorder->map_pending |= type == VOX_INSTANCE_MAP;
+    ++recorder->frame.instances;
+    return;
+  }
+
+  if (sprites->state == VOX_ERROR) {
+    sprites_resolve_state(sprites);
+  }
+
+  command.state = sprites->state;
+  command.layer = sprites->layer;
+  command.format = sprites_format(command, has_compact);
+  sprites_add(sprites, command);
+  ++sprites->frame.instances;
+}
+
+// Draws what's batched along with the commands recorded in deferred mode
+static void sprites_draw_pending(Sprites* sprites, SpritesFlushReason reason) {
+  CommandBuffer* commands = &sprites->commands;
+  if (!commands->commands.empty()) {
+    const uint32_t* order = command_buffer_sort(commands);
+    for (size_t i = 0; i < commands->commands.size(); ++i) {
+      sprites_write(sprites, commands->commands[order[i]]);
+    }
+    command_buffer_reset(commands);
+  }
+
+  sprites_draw_batch(sprites, reason);
+}
+
+// Uploads the recording's map changes up to the next sync once the map() draws before them
+// are done with the old tiles
+static void sprites_merge_map(Sprites* sprites, SpritesRecorder* recorder, size_t sync) {
+  const MapChanges* changes = &recorder->map_changes;
+  size_t first = sync > 0 ? recorder->map_syncs[sync - 1].upload : 0;
+  size_t last = sync < recorder->map_syncs.size() ? recorder->map_syncs[sync].upload
+                                                  : changes->uploads.size();
+  if (first < last && sprites->map) {
+    if (sprites->map_pending) {
+      sprites_draw_pending(sprites, SPRITES_FLUSH_MAP);
+    }
+    sprites->frame.bytes += map_upload_changes(sprites->map, changes, first, last);
+  }
+}
+
+static void sprites_merge(Sprites* sprites, SpritesRecorder* recorder) {
+  recorder->remap.assign(recorder->states.size() / 16, VOX_ERROR);
+
+  size_t sync = 0;
+  sprites_merge_map(sprites, recorder, sync);
+  for (size_t i = 0; i < recorder->commands.size(); ++i) {
+    while (sync < recorder->map_syncs.size() && recorder->map_syncs[sync].command == i) {
+      sprites_merge_map(sprites, recorder, ++sync);
+    }
+
+    Command command = recorder->commands[i];
+
+    unsigned int state = recorder->remap[command.state];
+    if (state == VOX_ERROR) {
+      unsigned int count = sprites->state_count;
+      state = sprites_find_state(sprites, &recorder->states[command.state * 16]);
+      if (sprites->state_count < count) {
+        // The frame's states were used up and started over
+        std::fill(recorder->remap.begin(), recorder->remap.end(), VOX_ERROR);
+      }
+      recorder->remap[command.state] = state;
+    }
+
+    command.state = state;
+    command.format = sprites_format(command, command.format == VOX_FORMAT_COMPACT);
+    sprites_add(sprites, command);
+  }
+
+  sprites->frame.instances += recorder->frame.instances;
+  sprites->frame.culled += recorder->frame.culled;
+  sprites->frame.clipped += recorder->frame.clipped;
+
+  // Changes after the last draw
+  while (sync < recorder->map_syncs.size()) {
+    sprites_merge_map(sprites, recorder, ++sync);
+  }
+
+  recorder->commands.clear();
+  recorder->states.clear();
+  map_clear_changes(&recorder->map_changes);
+  recorder->map_syncs.clear();
+}
+
+void sprites_begin_recording(SpritesRecorder* recorder, unsigned int group) {
+  recorder->group = group;
+  recorder->commands.clear();
+  recorder->states.clear();
+  recorder->state = VOX_ERROR;
+  recorder->layer = 0;
+  map_clear_changes(&recorder->map_changes);
+  recorder->map_syncs.clear();
+  recorder->map_pending = false;
+  memset(&recorder->frame, 0, sizeof(recorder->frame));
+
+  // Every recording starts from the default palette, whichever thread it's made on
+  memcpy(sprites_saved_color_map, shader_color_map, sizeof(sprites_saved_color_map));
+  memcpy(sprites_saved_alpha_map, shader_alpha_map, sizeof(sprites_saved_alpha_map));
+  for (int i = 0; i < 16; ++i) {
+    shader_color_map[i] = i;
+    shader_alpha_map[i] = i == 0;
+  }
+
+  sprites_recorder = recorder;
+}
+
+void sprites_end_recording() {
+  memcpy(shader_color_map, sprites_saved_color_map, sizeof(sprites_saved_color_map));
+  memcpy(shader_alpha_map, sprites_saved_alpha_map, sizeof(sprites_saved_alpha_map));
+  sprites_recorder = nullptr;
+}
+
+bool sprites_is_recording() { return sprites_recorder != nullptr; }
+
+void sprites_submit(Sprites* sprites, SpritesRecorder* recorder) {
+  std::lock_guard<std::mutex> lock(sprites->submitted_mutex);
+  sprites->submitted.push_back(recorder);
+}
+
+void sprites_carry_map_changes(SpritesRecorder* recorder, const SpritesRecorder* dropped) {
+  for (SpritesMapSync& sync : recorder->map_syncs) {
+    sync.upload += dropped->map_changes.uploads.size();
+  }
+  map_prepend_changes(&recorder->map_changes, &dropped->map_changes);
+}
+
+static bool sprites_group_less(const SpritesRecorder* a, const SpritesRecorder* b) {
+  return a->group < b->group;
+}
+
+void sprites_flush(Sprites* sprites, SpritesFlushReason reason) {
+  TRACE_GL("sprites_flush");
+  profiler_begin_flush();
+  ++sprites->frame.flushes;
+
+  // Taken out first since merging can flush again when it runs out of palette states
+  std::vector<SpritesRecorder*> submitted;
+  {
+    std::lock_guard<std::mutex> lock(sprites->submitted_mutex);
+    submitted.swap(sprites->submitted);
+  }
+
+  std::stable_sort(submitted.begin(), submitted.end(), sprites_group_less);
+  for (size_t i = 0; i < submitted.size(); ++i) {
+    sprites_merge(sprites, submitted[i]);
+  }
+
+  sprites_draw_pending(sprites, reason);
+  profiler_end_flush();
+}
+
+// Drops instances whose bounding box is entirely off the screen
+static bool sprites_cull(Sprites* sprites, int x, int y, int w, int h) {
+  int x0 = std::min(x, x + w);
+  int y0 = std::min(y, y + h);
+  int x1 = std::max(x, x + w);
+  int y1 = std::max(y, y + h);
+  if (x0 == x1 || y0 == y1 || x1 <= 0 || y1 <= 0 || x0 >= VOX_WIDTH || y0 >= VOX_WIDTH) {
+    ++sprites_frame(sprites)->culled;
+    return true;
+  }
+  return false;
+}
+
+// Trims [x, x + w) to the screen, returns the amount cut from the start and the end
+static bool sprites_clip(int* x, int* w, int* start, int* end) {
+  *start = std::max(0, -*x);
+  *end = std::max(0, *x + *w - VOX_WIDTH);
+  *x += *start;
+  *w -= *start + *end;
+  return *start > 0 || *end > 0;
+}
+
+void sprites_draw(Sprites* sprites, unsigned int bank, int sx, int sy, int sw, int sh, int dx,
+                  int dy, int dw, int dh, bool flipx, bool flipy) {
+  if (sprites_cull(sprites, sx, sy, sw, sh)) {
+    return;
+  }
+
+  // Unscaled 8x8 sprites on the grid of the font or the first game bank only need their
+  // position and number, the compact format has a single bit for the bank
+  bool has_compact = bank <= VOX_BANK_GAME && !flipx && !flipy && sw == VOX_SPRITE_WIDTH &&
+                     sh == VOX_SPRITE_WIDTH && dw == VOX_SPRITE_WIDTH &&
+                     dh == VOX_SPRITE_WIDTH && dx >= 0 && dx < VOX_SPRITES_WIDTH && dy >= 0 &&
+                     dy < VOX_SPRITES_WIDTH && dx % VOX_SPRITE_WIDTH == 0 &&
+                     dy % VOX_SPRITE_WIDTH == 0 &&
+                     sx >= -VOX_SPRITE_WIDTH && sx < 256 - VOX_SPRITE_WIDTH &&
+                     sy >= -VOX_SPRITE_WIDTH && sy < 256 - VOX_SPRITE_WIDTH;
+  uint32_t compact = 0;
+  if (has_compact) {
+    int n = dx / VOX_SPRITE_WIDTH + dy / VOX_SPRITE_WIDTH * VOX_SPRITES_COUNT;
+    compact = ((sx + VOX_SPRITE_WIDTH) << 24) | ((sy + VOX_SPRITE_WIDTH) << 16) | (n << 8) |
+              (bank << 7);
+  } else if (sw == dw && sh == dh && sw > 0 && sh > 0) {
+    // Unscaled sprites are trimmed together with their source rectangle, a flipped sprite
+    // loses texels from the opposite side. Scaled ones would need fractional texels so
+    // those are left to the rasterizer. Compact sprites are already as small as they get.
+    int left, right, top, bottom;
+    bool clipped = sprites_clip(&sx, &sw, &left, &right);
+    clipped |= sprites_clip(&sy, &sh, &top, &bottom);
+    if (clipped) {
+      dx += flipx ? right : left;
+      dy += flipy ? bottom : top;
+      dw = sw;
+      dh = sh;
+      ++sprites_frame(sprites)->clipped;
+    }
   }
 
   if (flipx) dw = -dw;
   if (flipy) dh = -dh;
 
-  sx = clamp(sx);
-  sy = clamp(sy);
-  sw = clamp(sw);
-  sh = clamp(sh);
-
-  glm::uvec2 s;
-  s.x = (((uint8_t)(sx + 127) & 0xFF) << 24) | (((uint8_t)(sy + 127) & 0xFF) << 16) |
-        (((uint8_t)(sw + 127) & 0xFF) << 8) | (((uint8_t)(sh + 127) & 0xFF) << 0);
-  s.y = (((uint8_t)(dx + 127) & 0xFF) << 24) | (((uint8_t)(dy + 127) & 0xFF) << 16) |
-        (((uint8_t)(dw + 127) & 0xFF) << 8) | (((uint8_t)(dh + 127) & 0xFF) << 0);
-  sprites->batch[sprites->batch_count++] = s;
+  sprites_emit(sprites, sx, sy, sw, sh, sprites_pack_rect(dx, dy, dw, dh), VOX_INSTANCE_SPRITE,
+               bank, has_compact, compact);
+}
+
+static void sprites_primitive(Sprites* sprites, int type, int x, int y, int w, int h, int c) {
+  // Lines and ovals are only culled since their shape depends on the whole bounding box
+  if (sprites_cull(sprites, x, y, w, h)) {
+    return;
+  }
+  sprites_emit(sprites, x, y, w, h, c, type);
+}
+
+void sprites_fill(Sprites* sprites, int x, int y, int w, int h, int c) {
+  if (sprites_cull(sprites, x, y, w, h)) {
+    return;
+  }
+
+  if (w > 0 && h > 0) {
+    int start, end;
+    bool clipped = sprites_clip(&x, &w, &start, &end);
+    clipped |= sprites_clip(&y, &h, &start, &end);
+    if (clipped) ++sprites_frame(sprites)->clipped;
+  }
+
+  sprites_emit(sprites, x, y, w, h, c & 0x0F, VOX_INSTANCE_FILL);
+}
+
+void sprites_line(Sprites* sprites, int x0, int y0, int x1, int y1, int c) {
+  // Lines are drawn across their bounding box, from top-left to bottom-right unless flipped
+  int flip = ((x1 - x0) < 0) != ((y1 - y0) < 0) ? 0x10 : 0x00;
+  int x = std::min(x0, x1);
+  int y = std::min(y0, y1);
+  int w = std::abs(x1 - x0) + 1;
+  int h = std::abs(y1 - y0) + 1;
+  sprites_primitive(sprites, VOX_INSTANCE_LINE, x, y, w, h, (c & 0x0F) | flip);
+}
+
+void sprites_oval(Sprites* sprites, int x0, int y0, int x1, int y1, int c, bool fill) {
+  int x = std::min(x0, x1);
+  int y = std::min(y0, y1);
+  int w = std::abs(x1 - x0) + 1;
+  int h = std::abs(y1 - y0) + 1;
+  sprites_primitive(sprites, fill ? VOX_INSTANCE_OVALFILL : VOX_INSTANCE_OVAL, x, y, w, h,
+                    c & 0x0F);
+}
+
+void sprites_map(Sprites* sprites, unsigned int bank, int x, int y, int w, int h, int mx, int my,
+                 uint8_t layers) {
+  if (!sprites->map || w <= 0 || h <= 0 || sprites_cull(sprites, x, y, w, h)) {
+    return;
+  }
+
+  // Only the part of the map on the GPU can be drawn, the rest is trimmed like the part off
+  // the screen
+  int rx, ry, rw, rh;
+  map_resident(sprites->map, &rx, &ry, &rw, &rh);
+  rx *= VOX_SPRITE_WIDTH;
+  ry *= VOX_SPRITE_WIDTH;
+  int left = std::max(0, rx - mx);
+  int top = std::max(0, ry - my);
+  int right = std::max(0, mx + w - (rx + rw * VOX_SPRITE_WIDTH));
+  int bottom = std::max(0, my + h - (ry + rh * VOX_SPRITE_WIDTH));
+  x += left;
+  y += top;
+  w -= left + right;
+  h -= top + bottom;
+  mx += left;
+  my += top;
+
+  int start, end;
+  bool clipped = sprites_clip(&x, &w, &start, &end);
+  mx += start;
+  clipped |= sprites_clip(&y, &h, &start, &end);
+  my += start;
+  if (w <= 0 || h <= 0) {
+    ++sprites_frame(sprites)->culled;
+    return;
+  }
+  if (clipped) ++sprites_frame(sprites)->clipped;
+
+  // The texture wraps around so the position within it is all the shader needs
+  const int wrap = VOX_MAP_WINDOW * VOX_SPRITE_WIDTH - 1;
+  uint32_t params = static_cast<uint32_t>(mx & wrap) | (static_cast<uint32_t>(my & wrap) << 12) |
+                    (static_cast<uint32_t>(layers) << 24);
+  sprites_emit(sprites, x, y, w, h, params, VOX_INSTANCE_MAP, bank);
 }
@@ -1,17 +1,116 @@
 #version 330 core
+#ifdef VOX_INDEXED
+out uint FragIndex;
+#else
 out vec4 FragColor;
+#endif
 
 in vec2 TexCoord;
+in vec2 Local;
+flat in uint State;
+flat in uint Type;
+flat in uint Color;
+flat in uint Bank;
+flat in ivec2 Size;
 
-uniform usampler2D Texture;
+uniform usampler2DArray Texture; // One layer per sprite bank
+
+// One row per draw state, each texel is the mapped color with 0x10 set for transparency
+uniform usampler2D PaletteStates;
 
 uniform vec3 palette[16];
-uniform bool alphaMap[16];
-uniform int colorMap[16];
 
-void main() {
-  int index = int(texture(Texture, TexCoord).r);
-  if (alphaMap[index])
+// Sprite numbers of the map tiles around the focus, wrapping around, and the flags of every
+// sprite
+uniform usampler2D Map;
+uniform usampler2D SpriteFlags;
+
+const uint INSTANCE_SPRITE = 0u;
+const uint INSTANCE_FILL = 1u;
+const uint INSTANCE_LINE = 2u;
+const uint INSTANCE_OVAL = 3u;
+const uint INSTANCE_OVALFILL = 4u;
+const uint INSTANCE_MAP = 5u;
+
+// Pixel centers within the ellipse inscribed in the size.x by size.y box. e is twice the
+// distance from the center so everything stays in exact integer math: (e.x / w)^2 +
+// (e.y / h)^2 <= 1. For circles this is x^2 + y^2 <= r^2 + r.
+#ifdef VOX_FORMAT_WIDE
+// Sizes up to 32767 need 60 bits, products are (high, low) pairs since there's no umulExtended
+uvec2 mul64(uint a, uint b) {
+  uint low = (a & 0xFFFFu) * (b & 0xFFFFu);
+  uint mid0 = (a >> 16u) * (b & 0xFFFFu);
+  uint mid1 = (a & 0xFFFFu) * (b >> 16u);
+  uint mid = (low >> 16u) + (mid0 & 0xFFFFu) + (mid1 & 0xFFFFu);
+  uint high = (a >> 16u) * (b >> 16u) + (mid0 >> 16u) + (mid1 >> 16u) + (mid >> 16u);
+  return uvec2(high, (mid << 16u) | (low & 0xFFFFu));
+}
+
+bool inside_oval(uvec2 e, uvec2 size) {
+  if (e.y > size.y) return false;
+  uvec2 a = mul64(e.x * e.x, size.y * size.y);
+  uvec2 b = mul64(size.x * size.x, size.y * size.y - e.y * e.y);
+  return a.x < b.x || (a.x == b.x && a.y <= b.y);
+}
+#else
+bool inside_oval(uvec2 e, uvec2 size) {
+  if (e.y > size.y) return false;
+  return e.x * e.x * size.y * size.y <= size.x * size.x * (size.y * size.y - e.y * e.y);
+}
+#endif
+
+bool covered(ivec2 p) {
+  if (Type == INSTANCE_LINE) {
+    // Steps along the major axis rounding the minor one, matching Bresenham
+    int dx = Size.x - 1;
+    int dy = Size.y - 1;
+    if ((Color & 0x10u) != 0u) p.y = dy - p.y;
+    if (dx >= dy) return dx == 0 || p.y == (p.x * dy * 2 + dx) / (2 * dx);
+    return p.x == (p.y * dx * 2 + dy) / (2 * dy);
+  }
+
+  uvec2 size = uvec2(Size);
+  uvec2 e = uvec2(abs(p * 2 - (Size - 1)));
+  if (!inside_oval(e, size)) return false;
+  if (Type == INSTANCE_OVALFILL) return true;
+
+  // Outlines keep the pixels with a neighbor outside the ellipse
+  return !inside_oval(e + uvec2(2u, 0u), size) || !inside_oval(e + uvec2(0u, 2u), size);
+}
+
+// The color index of the map at the given pixel of the map texture, instances are trimmed to
+// what the texture holds
+uint map_index(ivec2 p, uint layers) {
+  uint tile = texelFetch(Map, (p / 8) & (textureSize(Map, 0) - 1), 0).r;
+  uint flags = texelFetch(SpriteFlags, ivec2(int(tile), 0), 0).r;
+  if (tile == 0u || (flags & layers) != layers)
     discard;
-  FragColor = vec4(palette[colorMap[index]], 1.0);
+  ivec2 texel = ivec2(int(tile & 0xFu) * 8, int(tile >> 4u) * 8) + (p & 7);
+  return texelFetch(Texture, ivec3(texel, int(Bank)), 0).r;
+}
+
+void main() {
+  uint entry;
+  if (Type == INSTANCE_SPRITE || Type == INSTANCE_MAP) {
+    uint index;
+    if (Type == INSTANCE_SPRITE) {
+      index = textureLod(Texture, vec3(TexCoord, float(Bank)), 0.0).r;
+    } else {
+      ivec2 origin = ivec2(int(Color & 0xFFFu), int((Color >> 12u) & 0xFFFu));
+      index = map_index(origin + ivec2(floor(Local)), Color >> 24u);
+    }
+    entry = texelFetch(PaletteStates, ivec2(int(index), int(State)), 0).r;
+    if ((entry & 0x10u) != 0u)
+      discard;
+  } else {
+    if (Type != INSTANCE_FILL && !covered(ivec2(floor(Local))))
+      discard;
+    // Primitives are remapped by pal() but ignore palt()
+    entry = texelFetch(PaletteStates, ivec2(int(Color & 0x0Fu), int(State)), 0).r;
+  }
+#ifdef VOX_INDEXED
+  FragIndex = entry & 0x0Fu;
+#else
+  FragColor = vec4(palette[entry & 0x0Fu], 1.0);
+#endif
 }
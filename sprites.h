@@ -1,22 +1,142 @@
 #ifndef SPRITES_H
 #define SPRITES_H
 
-#include <glm/glm.hpp>
+#include "commands.h"
+#include "map.h"
+#include "stream.h"
 
-#define VOX_MAX_SPRITE_BATCH 8192
+#include <mutex>
+#include <vector>
+
+#define VOX_SPRITE_STREAM_REGIONS 3
+#define VOX_SPRITE_REGION_INSTANCES 65536
+
+#define VOX_PALETTE_STATES 256 // Distinct pal()/palt() states per frame
+
+#define VOX_SPRITES_INDEXED 0x01 // Output color indices for the screen framebuffer
+#define VOX_SPRITES_VERTEX_PULLING 0x02 // Fetch instances from a buffer texture, no attributes
+#define VOX_SPRITES_DEFERRED 0x04 // Record draws and sort them by layer and format when flushed
+
+// Instance formats in increasing size, a batch uses the widest format among its instances
+#define VOX_FORMAT_COMPACT 0  // 4 bytes, unscaled 8x8 sprites on the grid of the first two banks
+#define VOX_FORMAT_STANDARD 1 // 12 bytes, 8-bit coordinates
+#define VOX_FORMAT_WIDE 2     // 16 bytes, 16-bit coordinates
+#define VOX_FORMAT_COUNT 3
+
+#define VOX_COMPACT_STATES 128 // Palette states addressable by compact instances
+
+// Instance types, stored in bits 8-10 of an instance's info word. The bank is in bits 16-23.
+#define VOX_INSTANCE_SPRITE 0
+#define VOX_INSTANCE_FILL 1 // Solid rectangle, the second component holds the color
+#define VOX_INSTANCE_LINE 2 // Line across its bounding box, bit 4 of the color flips it vertically
+#define VOX_INSTANCE_OVAL 3 // Ellipse outline inscribed in its bounding box
+#define VOX_INSTANCE_OVALFILL 4
+#define VOX_INSTANCE_MAP 5 // Tiles of the map, the second component holds where and which layers
+
+// Why a batch was drawn
+enum SpritesFlushReason {
+  SPRITES_FLUSH_EXPLICIT,     // sprites_flush() from outside, cls() does this
+  SPRITES_FLUSH_END_OF_FRAME,
+  SPRITES_FLUSH_PALETTE,      // Every palette state of the frame is in use
+  SPRITES_FLUSH_BATCH_FULL,   // The stream region is used up
+  SPRITES_FLUSH_FORMAT,       // An instance needs a wider format than the batch
+  SPRITES_FLUSH_MAP,          // The map changed under pending map() draws
+  SPRITES_FLUSH_REASON_COUNT,
+};
+
+struct SpritesCounters {
+  unsigned int instances; // Instances that made it into a batch
+  unsigned int culled;    // Instances entirely off the screen
+  unsigned int clipped;   // Instances trimmed to the screen
+  unsigned int draws;     // Draw calls
+  unsigned int flushes;   // sprites_flush() calls
+  unsigned int bytes;     // Instance and palette state data uploaded
+  unsigned int reasons[SPRITES_FLUSH_REASON_COUNT]; // Draw calls by why the batch was drawn
+};
+
+// Where a recording changed a held map under its own map() draws
+struct SpritesMapSync {
+  size_t command; // Commands recorded before the change
+  size_t upload;  // Map uploads taken before it
+};
+
+// Draws recorded on another thread, merged into the frame at the next flush. Its palette
+// states are local and get mapped to the frame's when merged, map changes taken while
+// recording are uploaded then.
+struct SpritesRecorder {
+  unsigned int group; // Recorders are merged in group order
+  std::vector<Command> commands;
+  std::vector<uint8_t> states; // 16 entries per state, like Sprites::states
+  std::vector<unsigned int> remap; // Local state to frame state while merging
+  unsigned int state;
+  unsigned int layer;
+  MapChanges map_changes;
+  std::vector<SpritesMapSync> map_syncs;
+  bool map_pending; // A map() draw was recorded since the last sync
+  SpritesCounters frame;
+};
 
 struct Sprites {
-  unsigned int shader;
-  unsigned int texture;
+  unsigned int flags;
+  unsigned int shaders[VOX_FORMAT_COUNT]; // One program per instance format
+  unsigned int texture; // R8UI array, one VOX_SPRITES_WIDTH square layer per bank
+  unsigned int palette_texture;
+  Map* map; // Uploaded before a batch is drawn when it changed
+  bool map_pending; // A map() draw is batched or recorded in deferred mode
+  uint8_t states[VOX_PALETTE_STATES][16]; // Color index in the low nibble, 0x10 if transparent
+  unsigned int state_count;
+  unsigned int state_uploaded;
+  unsigned int state; // Index of the current draw state, VOX_ERROR when it needs resolving
   unsigned int vao;
-  unsigned int instance_vbo;
-  glm::uvec2 batch[VOX_MAX_SPRITE_BATCH];
+  unsigned int instance_texture; // Buffer texture over the stream when vertex pulling
+  int instance_base_locations[VOX_FORMAT_COUNT];
+  Stream stream;
+  uint32_t* batch; // Points into the stream's current region
   unsigned int batch_count;
+  unsigned int batch_format;
+  size_t batch_capacity; // Bytes left in the region
+  CommandBuffer commands; // Draws recorded in deferred mode
+  unsigned int layer;
+  std::mutex submitted_mutex;
+  std::vector<SpritesRecorder*> submitted;
+  SpritesCounters frame;
+  SpritesCounters last;
 };
 
-bool sprites_init(Sprites* sprites);
-void sprites_flush(Sprites* sprites);
-void sprites_draw(Sprites* sprites, int sx, int sy, int sw, int sh, int dx, int dy, int dw, int dh,
-                  bool flipx = false, bool flipy = false);
+int sprites_clamp(int v); // Limits a coordinate to what the wide format holds
+
+bool sprites_init(Sprites* sprites, unsigned int flags = 0);
+void sprites_flush(Sprites* sprites, SpritesFlushReason reason = SPRITES_FLUSH_EXPLICIT);
+void sprites_end_frame(Sprites* sprites);
+void sprites_palette_changed(Sprites* sprites);
+void sprites_layer(Sprites* sprites, int layer);
+void sprites_set_map(Sprites* sprites, Map* map);
+// Before the map changes. Pending map() draws of the calling thread are drawn first, or on
+// a recording thread the changes so far are taken out of a held map to be uploaded in order.
+void sprites_map_changing(Sprites* sprites);
+bool sprites_load_bank(Sprites* sprites, unsigned int bank, const char* filename);
+const SpritesCounters* sprites_counters(const Sprites* sprites); // Totals for the last frame
+const char* sprites_flush_reason_name(SpritesFlushReason reason);
+
+// Draw calls made on the calling thread go to the recorder between these two calls, flushing
+// and everything else touching GL stays on the main thread. Recordings start from the default
+// palette, the thread's own is back once the recording ends.
+void sprites_begin_recording(SpritesRecorder* recorder, unsigned int group);
+void sprites_end_recording();
+bool sprites_is_recording();
+// Can be called from any thread, the recorder must stay untouched until the next flush
+void sprites_submit(Sprites* sprites, SpritesRecorder* recorder);
+// The map changes of a recording dropped without being submitted go before the recorder's own
+void sprites_carry_map_changes(SpritesRecorder* recorder, const SpritesRecorder* dropped);
+
+void sprites_draw(Sprites* sprites, unsigned int bank, int sx, int sy, int sw, int sh, int dx,
+                  int dy, int dw, int dh, bool flipx = false, bool flipy = false);
+void sprites_fill(Sprites* sprites, int x, int y, int w, int h, int c);
+void sprites_line(Sprites* sprites, int x0, int y0, int x1, int y1, int c);
+void sprites_oval(Sprites* sprites, int x0, int y0, int x1, int y1, int c, bool fill = false);
+// Draws the map pixels from mx, my at x, y as a single instance, only tiles that have every
+// flag in layers
+void sprites_map(Sprites* sprites, unsigned int bank, int x, int y, int w, int h, int mx, int my,
+                 uint8_t layers);
 
 #endif // SPRITES_H
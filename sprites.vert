@@ -1,39 +1,119 @@
 #version 330 core
+// Built once per instance format, VOX_FORMAT_COMPACT, VOX_FORMAT_STANDARD or VOX_FORMAT_WIDE
+#if defined(VOX_FORMAT_COMPACT)
+#define INSTANCE_WORDS 1
+#elif defined(VOX_FORMAT_WIDE)
+#define INSTANCE_WORDS 4
+#else
+#define INSTANCE_WORDS 3
+#endif
+
+#ifdef VOX_VERTEX_PULLING
+// Packed instances fetched by gl_VertexID, six vertices per instance
+uniform usamplerBuffer Instances;
+uniform int instanceBase; // Offset of the batch in words
+
+const vec2 CORNERS[6] = vec2[](vec2(1.0, 1.0), vec2(1.0, 0.0), vec2(0.0, 1.0),
+                               vec2(1.0, 0.0), vec2(0.0, 0.0), vec2(0.0, 1.0));
+#else
 layout (location = 0) in vec3 pos;
 layout (location = 1) in vec2 tex;
-layout (location = 2) in uvec2 params;
+layout (location = 2) in uvec4 params; // Only INSTANCE_WORDS components are supplied
+#endif
 
-// params.x =  (posx, posy, width, height)
+// Standard format:
+// params.x = (posx, posy, width, height)
 // params.y = (tex_posx, tex_posy, tex_width, tex_height) // Use the sign of tex_width/tex_height for flipping
+//            or the color (and flags) for primitives
+//            or for maps where in the map texture it starts (bits 0-11, 12-23) and layers (24-31)
+// params.z = palette state index (bits 0-7), instance type (bits 8-10), bank (bits 16-23)
+//
+// Wide format, the standard one with signed 16-bit coordinates:
+// params.x = posx (bits 0-15), posy (bits 16-31)
+// params.y = width (bits 0-15), height (bits 16-31)
+// params.z, params.w = params.y, params.z of the standard format
+//
+// Compact format, an unscaled 8x8 sprite:
+// params.x = posx + 8 (bits 24-31), posy + 8 (bits 16-23), sprite number (bits 8-15),
+//            bank 0 or 1 (bit 7), palette state index (bits 0-6)
 
 uniform mat4 proj;
 
 out vec2 TexCoord;
+out vec2 Local; // Position inside the instance's rectangle in screen pixels
+flat out uint State;
+flat out uint Type;
+flat out uint Color;
+flat out uint Bank;
+flat out ivec2 Size;
+
+const uint INSTANCE_SPRITE = 0u;
 
 const float SPRITE_TEX_WIDTH = 128.0;
-const float SPRITE_TEX_HEIGHT = 256.0;
+const float SPRITE_TEX_HEIGHT = 128.0;
+
+vec4 unpack_biased(uint v) {
+  return vec4(float((v >> 24u) & 0xFFu), float((v >> 16u) & 0xFFu), float((v >> 8u) & 0xFFu),
+              float(v & 0xFFu)) - 127.0;
+}
+
+vec2 unpack_signed(uint v) {
+  return vec2(float(int(v << 16u) >> 16), float(int(v) >> 16));
+}
 
 void main() {
-  float sx = float((params.x >> 24u) & 0xFFu) - 127;
-  float sy = float((params.x >> 16u) & 0xFFu) - 127;
-  float sw = float((params.x >> 8u) & 0xFFu) - 127;
-  float sh = float((params.x) & 0xFFu) - 127;
+#ifdef VOX_VERTEX_PULLING
+  int base = instanceBase + (gl_VertexID / 6) * INSTANCE_WORDS;
+  uvec4 params = uvec4(0u);
+  for (int i = 0; i < INSTANCE_WORDS; ++i) {
+    params[i] = texelFetch(Instances, base + i).r;
+  }
+  vec2 tex = CORNERS[gl_VertexID % 6];
+  vec3 pos = vec3(tex, 0.0);
+#endif
+
+  vec4 rect; // Screen position and size
+  vec4 src;  // Sprite sheet position and size
+  uint info;
+  uint color;
+#if defined(VOX_FORMAT_COMPACT)
+  uint n = (params.x >> 8u) & 0xFFu;
+  rect = vec4(float((params.x >> 24u) & 0xFFu) - 8.0, float((params.x >> 16u) & 0xFFu) - 8.0,
+              8.0, 8.0);
+  src = vec4(float((n & 0xFu) * 8u), float((n >> 4u) * 8u), 8.0, 8.0);
+  info = (params.x & 0x7Fu) | (((params.x >> 7u) & 0x1u) << 16u);
+  color = 0u;
+#elif defined(VOX_FORMAT_WIDE)
+  rect = vec4(unpack_signed(params.x), unpack_signed(params.y));
+  src = unpack_biased(params.z);
+  info = params.w;
+  color = params.z;
+#else
+  rect = unpack_biased(params.x);
+  src = unpack_biased(params.y);
+  info = params.z;
+  color = params.y;
+#endif
 
-  float dx = float((params.y >> 24u) & 0xFFu) - 127;
-  float dy = float((params.y >> 16u) & 0xFFu) - 127;
-  float dw = float((params.y >> 8u) & 0xFFu) - 127;
-  float dh = float((params.y) & 0xFFu) - 127;
+  gl_Position = proj * vec4((pos * vec3(rect.zw, 1.0)) + vec3(rect.xy, 0.0), 1.0);
+  State = info & 0xFFu;
+  Type = (info >> 8u) & 0x7u;
+  Color = color;
+  Bank = (info >> 16u) & 0xFFu;
+  Size = ivec2(rect.zw);
+  Local = pos.xy * rect.zw;
+  TexCoord = vec2(0.0);
 
-  float texx = dw < 0 ? 1 - tex.x : tex.x;
-  float texy = dh < 0 ? 1 - tex.y : tex.y;
+  if (Type == INSTANCE_SPRITE) {
+    float texx = src.z < 0 ? 1 - tex.x : tex.x;
+    float texy = src.w < 0 ? 1 - tex.y : tex.y;
 
-  float texw = abs(dw) / SPRITE_TEX_WIDTH;
-  float texh = abs(dh) / SPRITE_TEX_HEIGHT;
+    float texw = abs(src.z) / SPRITE_TEX_WIDTH;
+    float texh = abs(src.w) / SPRITE_TEX_HEIGHT;
 
-  float texox = dx / SPRITE_TEX_WIDTH;
-  float texoy = dy / SPRITE_TEX_HEIGHT;
+    float texox = src.x / SPRITE_TEX_WIDTH;
+    float texoy = src.y / SPRITE_TEX_HEIGHT;
 
-  gl_Position = proj * vec4((pos * vec3(sw, sh, 1.0)) + vec3(sx, sy, 0.0), 1.0);
-  TexCoord = vec2(texox + texx * texw, texoy + texy * texh);
-  //TexCoord = tex;
+    TexCoord = vec2(texox + texx * texw, texoy + texy * texh);
+  }
 }
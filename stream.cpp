@@ -0,0 +1,95 @@
+#include "stream.h"
+
+#include "glstate.h"
+
+#include <SDL_log.h>
+#include <epoxy/gl.h>
+
+#define VOX_STREAM_WAIT_TIMEOUT 1000000000 // 1 second
+
+bool stream_init(Stream* stream, size_t region_size, unsigned int region_count) {
+  if (region_count < 1) region_count = 1;
+  if (region_count > VOX_STREAM_MAX_REGIONS) region_count = VOX_STREAM_MAX_REGIONS;
+
+  stream->persistent =
+    epoxy_gl_version() >= 44 || epoxy_has_gl_extension("GL_ARB_buffer_storage");
+  stream->region_size = region_size;
+  stream->region_count = stream->persistent ? region_count : 1;
+  stream->region = 0;
+  stream->head = 0;
+  stream->mapped = nullptr;
+  for (unsigned int i = 0; i < VOX_STREAM_MAX_REGIONS; ++i) {
+    stream->fences[i] = nullptr;
+  }
+
+  glGenBuffers(1, &stream->buffer);
+  glBindBuffer(GL_ARRAY_BUFFER, stream->buffer);
+
+  if (stream->persistent) {
+    GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+    size_t size = region_size * stream->region_count;
+    glBufferStorage(GL_ARRAY_BUFFER, size, nullptr, flags);
+    stream->mapped = static_cast<uint8_t*>(glMapBufferRange(GL_ARRAY_BUFFER, 0, size, flags));
+    if (!stream->mapped) {
+      SDL_LogError(SDL_LOG_CATEGORY_APPLICATION, "Unable to map stream buffer");
+      glBindBuffer(GL_ARRAY_BUFFER, 0);
+      return false;
+    }
+    stream->data = stream->mapped;
+  } else {
+    glBufferData(GL_ARRAY_BUFFER, region_size, nullptr, GL_STREAM_DRAW);
+    stream->data = new uint8_t[region_size];
+  }
+
+  glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+  SDL_Log("Stream buffer: %s, %u region(s) of %zu bytes",
+          stream->persistent ? "persistent mapping" : "buffer orphaning", stream->region_count,
+          region_size);
+
+  return true;
+}
+
+size_t stream_commit(Stream* stream, size_t size) {
+  size_t offset = stream->head;
+
+  if (!stream->persistent) {
+    // Only ranges the GPU hasn't been handed yet are written so no implicit sync is needed
+    glstate_bind_buffer(GL_ARRAY_BUFFER, stream->buffer);
+    glBufferSubData(GL_ARRAY_BUFFER, offset, size, stream->data + offset);
+  }
+
+  stream->head += size;
+
+  return stream->region * stream->region_size + offset;
+}
+
+void stream_next_region(Stream* stream) {
+  stream->head = 0;
+
+  if (!stream->persistent) {
+    glstate_bind_buffer(GL_ARRAY_BUFFER, stream->buffer);
+    glBufferData(GL_ARRAY_BUFFER, stream->region_size, nullptr, GL_STREAM_DRAW);
+    return;
+  }
+
+  stream->fences[stream->region] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+  stream->region = (stream->region + 1) % stream->region_count;
+  stream->data = stream->mapped + stream->region * stream->region_size;
+
+  GLsync fence = stream->fences[stream->region];
+  if (fence) {
+    GLbitfield flags = GL_SYNC_FLUSH_COMMANDS_BIT;
+    while (true) {
+      GLenum result = glClientWaitSync(fence, flags, VOX_STREAM_WAIT_TIMEOUT);
+      if (result == GL_ALREADY_SIGNALED || result == GL_CONDITION_SATISFIED) break;
+      if (result == GL_WAIT_FAILED) {
+        SDL_LogError(SDL_LOG_CATEGORY_APPLICATION, "Unable to wait on stream fence");
+        break;
+      }
+      flags = 0;
+    }
+    glDeleteSync(fence);
+    stream->fences[stream->region] = nullptr;
+  }
+}
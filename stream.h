@@ -0,0 +1,31 @@
+#ifndef STREAM_H
+#define STREAM_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define VOX_STREAM_MAX_REGIONS 4
+
+typedef struct __GLsync* GLsync;
+
+// A streaming vertex buffer split into regions. With GL_ARB_buffer_storage
+// the whole buffer is persistently mapped and each region is guarded by a
+// fence, otherwise a single region is staged on the CPU and the buffer is
+// orphaned whenever it is reused.
+struct Stream {
+  unsigned int buffer;
+  bool persistent;
+  uint8_t* mapped;
+  uint8_t* data; // Write pointer for the current region (mapped or staged)
+  size_t region_size;
+  unsigned int region_count;
+  unsigned int region;
+  size_t head; // Bytes already committed in the current region
+  GLsync fences[VOX_STREAM_MAX_REGIONS];
+};
+
+bool stream_init(Stream* stream, size_t region_size, unsigned int region_count);
+size_t stream_commit(Stream* stream, size_t size);
+void stream_next_region(Stream* stream);
+
+#endif // STREAM_H
@@ -0,0 +1,876 @@
+#include "api.h"
+#include "color.h"
+#include "headless.h"
+#include "map.h"
+#include "quantize.h"
+#include "sprites.h"
+#include "vox.h"
+
+#include <SDL_log.h>
+#include <SDL_timer.h>
+#include <condition_variable>
+#include <epoxy/gl.h>
+#include <limits.h>
+#include <mutex>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <vector>
+
+// Draws deterministic scenes headless through every render path and checks that the last
+// frame of each is pixel for pixel the same as the golden hash, or as the first path's when
+// there's no golden file. Each path runs in its own process since the renderer can only be
+// initialized once. Mismatching frames are saved as PPM.
+
+#define GOLDEN_DEFAULT_FRAMES 3 // Enough to cycle through the stream's regions
+#define GOLDEN_WORKER_RATE 1000
+#define GOLDEN_FNV_OFFSET 2166136261u
+#define GOLDEN_FNV_PRIME 16777619u
+#define GOLDEN_ARCHIVE_BANKS 6 // Banks in the archive of the bank cache scene
+#define GOLDEN_ARCHIVE_BUDGET 2
+#define GOLDEN_LOAD_FRAMES 1000 // Frames to wait for banks to load
+#define GOLDEN_PINNED_BANK 1 // Game sheet, the even banks loaded around it hold the font
+#define GOLDEN_PINNED_FRAMES 24 // Drawn while other banks load, before the frames that count
+#define GOLDEN_LEVEL_WIDTH 8 // In chunks, twice the window across
+#define GOLDEN_LEVEL_HEIGHT 6
+#define GOLDEN_QUANTIZE_TAIL 7 // Pixels after a multiple of 8, as many as the SIMD loops leave
+
+struct GoldenScene {
+  const char* name;
+  void (*draw)();
+  bool (*prepare)(unsigned int fbo); // Before the frames that count, can draw some itself
+  bool (*check)(int frames);         // After them, false fails the path like prepare
+};
+
+struct GoldenPath {
+  const char* name;
+  bool indexed;
+  unsigned int sprites_flags;
+  bool threaded; // update() and draw() run on the worker
+};
+
+struct GoldenResult {
+  std::string scene;
+  uint32_t hash;
+  double ms; // Per frame, including waiting for the GPU
+};
+
+static const GoldenScene* golden_scene;
+static int golden_frame; // Frames of the scene drawn so far
+
+// The worker only draws a frame once it's allowed to so it draws the same ones as the other
+// paths, the scene and frame only change while it waits
+static bool golden_threaded;
+static int golden_allowed;
+static std::mutex golden_mutex;
+static std::condition_variable golden_allow;
+
+static void golden_next_frame(unsigned int fbo);
+
+static int golden_rnd(int n) { return static_cast<int>(rnd() % n); }
+
+static void golden_sprites() {
+  cls();
+  palt();
+  pal();
+  palt(14, true);
+  for (int i = 0; i < 500; ++i) {
+    spr(16 * 5 + golden_rnd(8), golden_rnd(144) - 8, golden_rnd(144) - 8, 1, 1, rnd() & 1,
+        rnd() & 1);
+  }
+}
+
+static void golden_sspr() {
+  cls(1);
+  palt();
+  pal();
+  sspr(10, 10, 16, 16, 0, 0, 8, 8, true, false);
+  sspr(40, 10, 8, 8, 16, 16, 8, 8, false, true);
+  sspr(60, 60, 32, 24, 8, 0, 16, 8, true, true);
+  sspr(100, 100, 8, 8, 0, 8);
+  sspr(0, 0, 16, 16, -40, -40, 300, 200); // Only fits the wide format
+}
+
+// The first sprites are drawn with the palette the previous frame left behind
+static void golden_palette() {
+  cls();
+  for (int i = 0; i < 4; ++i) {
+    spr(48 + i, 96 + i * 8, 112);
+  }
+  palt();
+  pal();
+  for (int i = 0; i < 16; ++i) {
+    pal(i, (i + 5) % 16);
+    spr(i, i * 8, i * 8);
+    pal();
+    spr(i + 16, i * 8, (i * 8 + 40) % 128);
+  }
+  palt(0, false);
+  palt(3, true);
+  spr(33, 100, 20, 2, 2);
+  palt();
+  pal(7, 12);
+  palt(0, false);
+}
+
+// More palette states than fit in a frame
+static void golden_states() {
+  cls();
+  palt();
+  pal();
+  for (int i = 0; i < 700; ++i) {
+    pal(golden_rnd(16), golden_rnd(16));
+    palt(golden_rnd(16), rnd() & 1);
+    spr(golden_rnd(256), golden_rnd(136) - 4, golden_rnd(136) - 4);
+  }
+  palt();
+  pal();
+}
+
+static void golden_primitives() {
+  cls();
+  palt();
+  pal();
+  rect(2, 2, 20, 12, 8);
+  rectfill(4, 4, 18, 10, 9);
+  rect(126, 126, 120, 120, 14);
+  pset(64, 64, 7);
+  circ(20, 40, 10, 7);
+  circfill(60, 40, 12, 8);
+  circfill(100, 40, 0, 10);
+  oval(5, 70, 60, 90, 12);
+  ovalfill(70, 70, 120, 80, 14);
+  oval(-200, -100, 300, 400, 11);
+  line(0, 127, 127, 100, 7);
+  line(10, 100, 30, 127, 10);
+  line(60, 90, 60, 127, 11);
+  line(-50, 0, 200, 60, 13);
+  pal(7, 8);
+  circ(40, 110, 15, 7);
+  pal();
+}
+
+static void golden_text() {
+  cls(1);
+  print("the quick brown fox", 0, 0);
+  print("jumps over 13 lazy dogs", 2, 9, 9);
+  print("0123456789 !?#%", -3, 120, 11);
+}
+
+// Sprites and fills crossing every edge, clipped or culled
+static void golden_edges() {
+  cls(3);
+  palt();
+  pal();
+  for (int i = 0; i < 3000; ++i) {
+    int w = golden_rnd(3) + 1, h = golden_rnd(3) + 1;
+    spr(golden_rnd(256), golden_rnd(200) - 36, golden_rnd(200) - 36, w, h, rnd() & 1, rnd() & 1);
+  }
+  for (int i = 0; i < 300; ++i) {
+    int x = golden_rnd(300) - 86, y = golden_rnd(300) - 86;
+    rectfill(x, y, x + golden_rnd(90), y + golden_rnd(90), golden_rnd(16));
+  }
+  sspr(8, 8, 24, 24, -10, -20, 40, 40, true, false);
+}
+
+// A scrolled map partly off the screen and the map, a layer filtered part and sprites on top
+static void golden_map() {
+  for (int y = 0; y < VOX_MAP_HEIGHT; ++y) {
+    for (int x = 0; x < VOX_MAP_WIDTH; ++x) {
+      mset(x, y, golden_rnd(4) == 0 ? 0 : golden_rnd(256));
+    }
+  }
+  for (int n = 0; n < VOX_MAP_SPRITES; ++n) {
+    fset(n, golden_rnd(256));
+  }
+
+  cls(1);
+  palt();
+  pal();
+  map(120, 58, -13, -6, 16, 16);
+  pal(7, 8);
+  palt(0, false);
+  map(0, 0, 20, 70, 12, 6, 0x05);
+  pal();
+  palt();
+  spr(5, 60, 60, 2, 2);
+  map(-2, -3, 90, 90);
+}
+
+// Bank 2 holds a second copy of the font, loaded before the scenes run
+static void golden_banks() {
+  cls(2);
+  palt();
+  pal();
+  for (int i = 0; i < 300; ++i) {
+    int b = golden_rnd(3);
+    bank(b);
+    int w = golden_rnd(2) + 1;
+    spr(golden_rnd(256), golden_rnd(144) - 8, golden_rnd(144) - 8, w, w, rnd() & 1, rnd() & 1);
+  }
+  for (int y = 0; y < 4; ++y) {
+    for (int x = 0; x < 4; ++x) {
+      mset(x, y, 'A' + y * 4 + x);
+    }
+  }
+  bank(VOX_BANK_FONT);
+  map(0, 0, 0, 0, 4, 4);
+  bank();
+  print("BANKS", 40, 60, 10);
+  sspr(80, 80, 32, 32, 0, 0, 16, 16);
+}
+
+static int golden_archive_first; // The scene draws with this archive bank and the next
+static bool golden_archive_hit;  // Both were on the GPU in the last frame drawn
+static BankCacheCounters golden_archive_counters; // Once they were
+
+// Two banks of an archive that doesn't fit in the cache
+static void golden_bank_cache() {
+  cls(1);
+  palt();
+  pal();
+  golden_archive_hit = true;
+  for (int i = 0; i < GOLDEN_ARCHIVE_BUDGET; ++i) {
+    golden_archive_hit &= use_bank(golden_archive_first + i);
+    for (int j = 0; j < 100; ++j) {
+      spr(golden_rnd(256), golden_rnd(144) - 8, golden_rnd(144) - 8);
+    }
+  }
+  bank();
+}
+
+// Packs GOLDEN_ARCHIVE_BANKS banks, the odd ones hold the game sheet and the even ones the font,
+// and opens them with a budget of GOLDEN_ARCHIVE_BUDGET
+static bool golden_open_archive() {
+  char filename[] = "/tmp/vox_golden_XXXXXX";
+  int fd = mkstemp(filename);
+  if (fd < 0) {
+    SDL_LogError(SDL_LOG_CATEGORY_APPLICATION, "Unable to create a bank archive");
+    return false;
+  }
+  close(fd);
+
+  const char* sheets[GOLDEN_ARCHIVE_BANKS];
+  for (int i = 0; i < GOLDEN_ARCHIVE_BANKS; ++i) {
+    sheets[i] = i % 2 ? "sprites1.png" : "pico8_font.png";
+  }
+  bool opened = bank_cache_pack(filename, sheets, GOLDEN_ARCHIVE_BANKS) &&
+                open_banks(filename, GOLDEN_ARCHIVE_BUDGET);
+  // The cache keeps it open
+  unlink(filename);
+  return opened;
+}
+
+// Packs the archive and waits for every pair of banks in turn, so the cache has to evict
+static bool golden_prepare_bank_cache(unsigned int fbo) {
+  if (!golden_open_archive()) {
+    return false;
+  }
+
+  for (int first = 0; first < GOLDEN_ARCHIVE_BANKS; first += GOLDEN_ARCHIVE_BUDGET) {
+    {
+      std::lock_guard<std::mutex> lock(golden_mutex);
+      golden_archive_first = first;
+      golden_archive_hit = false;
+    }
+    bool hit = false;
+    for (int i = 0; i < GOLDEN_LOAD_FRAMES && !hit; ++i) {
+      golden_next_frame(fbo);
+      std::lock_guard<std::mutex> lock(golden_mutex);
+      hit = golden_archive_hit;
+    }
+    if (!hit) {
+      SDL_LogError(SDL_LOG_CATEGORY_APPLICATION, "Archive banks %d and up never loaded", first);
+      return false;
+    }
+  }
+
+  golden_archive_counters = bank_counters();
+  if (golden_archive_counters.evictions != GOLDEN_ARCHIVE_BANKS - GOLDEN_ARCHIVE_BUDGET) {
+    SDL_LogError(SDL_LOG_CATEGORY_APPLICATION, "The bank cache evicted %u banks, not %d",
+                 golden_archive_counters.evictions,
+                 GOLDEN_ARCHIVE_BANKS - GOLDEN_ARCHIVE_BUDGET);
+    return false;
+  }
+  return true;
+}
+
+// Every frame that counted found both banks without loading or evicting any
+static bool golden_check_bank_cache(int frames) {
+  BankCacheCounters c = bank_counters();
+  const BankCacheCounters& before = golden_archive_counters;
+  bool valid = c.hits - before.hits == static_cast<unsigned int>(frames * GOLDEN_ARCHIVE_BUDGET) &&
+               c.misses == before.misses && c.evictions == before.evictions;
+  if (!valid) {
+    SDL_LogError(SDL_LOG_CATEGORY_APPLICATION,
+                 "Bank cache went from %u/%u/%u to %u/%u/%u hits/misses/evictions", before.hits,
+                 before.misses, before.evictions, c.hits, c.misses, c.evictions);
+  }
+  close_banks();
+  return valid;
+}
+
+// What the level file holds, which chunk a tile is in shows as well as where in it
+static uint8_t golden_level_tile(int x, int y) {
+  return static_cast<uint8_t>(x * 7 ^ y * 13 ^ (x / VOX_MAP_CHUNK + y / VOX_MAP_CHUNK) * 37);
+}
+
+// A level bigger than the window, its tiles changed inside and outside of it and drawn
+// before and after each change, across chunks and across the seam where the texture wraps
+static void golden_level() {
+  cls(1);
+  palt();
+  pal();
+
+  // The window covers chunks 0 to 3 both ways
+  focus_map(100, 100);
+  mset(127, 64, golden_level_tile(127, 64));
+  map(122, 60, 0, 0, 8, 8);
+  mset(127, 64, 16 + golden_frame);
+  map(122, 60, 64, 0, 8, 8);
+
+  // Chunks 3 to 6 across and 2 to 5 down, tile 256 both ways is where the texture wraps
+  focus_map(330, 230);
+  map(252, 252, 0, 64, 8, 8);
+  if (golden_frame == 0) {
+    // Has to last while the window moves away and back in the frames after
+    mset(20, 350, 32);
+  }
+
+  focus_map(40, 330);
+  map(16, 346, 64, 64, 8, 8);
+}
+
+// Writes the level, changes a tile inside the window and one outside, saves it to another
+// file and loads that back
+static bool golden_prepare_level(unsigned int fbo) {
+  char filename[] = "/tmp/vox_golden_XXXXXX";
+  char saved[] = "/tmp/vox_golden_XXXXXX";
+  int fd = mkstemp(filename);
+  int saved_fd = mkstemp(saved);
+  if (fd >= 0) {
+    close(fd);
+  }
+  if (saved_fd >= 0) {
+    close(saved_fd);
+  }
+  if (fd < 0 || saved_fd < 0) {
+    SDL_LogError(SDL_LOG_CATEGORY_APPLICATION, "Unable to create a level file");
+    return false;
+  }
+
+  FILE* f = fopen(filename, "wb");
+  bool written = f != nullptr;
+  if (f) {
+    MapFileHeader header = {};
+    memcpy(header.magic, VOX_MAP_FILE_MAGIC, 4);
+    header.width = GOLDEN_LEVEL_WIDTH;
+    header.height = GOLDEN_LEVEL_HEIGHT;
+    // No flags so map() draws every tile
+    std::vector<uint8_t> chunk(VOX_MAP_FILE_TILES);
+    memcpy(chunk.data(), &header, sizeof(header));
+    fwrite(chunk.data(), chunk.size(), 1, f);
+    for (int cy = 0; cy < GOLDEN_LEVEL_HEIGHT; ++cy) {
+      for (int cx = 0; cx < GOLDEN_LEVEL_WIDTH; ++cx) {
+        for (int y = 0; y < VOX_MAP_CHUNK; ++y) {
+          for (int x = 0; x < VOX_MAP_CHUNK; ++x) {
+            chunk[y * VOX_MAP_CHUNK + x] =
+              golden_level_tile(cx * VOX_MAP_CHUNK + x, cy * VOX_MAP_CHUNK + y);
+          }
+        }
+        fwrite(chunk.data(), chunk.size(), 1, f);
+      }
+    }
+    written = !ferror(f);
+    fclose(f);
+  }
+
+  bool loaded = written && load_map(filename);
+  if (loaded) {
+    focus_map(0, 0);
+    mset(10, 10, 200);
+    mset(500, 380, 201);
+    loaded = save_map(saved) && load_map(saved);
+  }
+  // The map keeps what it loaded mapped
+  unlink(filename);
+  unlink(saved);
+  if (!loaded) {
+    return false;
+  }
+
+  const int tiles[][3] = {
+    { 10, 10, 200 },
+    { 500, 380, 201 },
+    { 0, 0, golden_level_tile(0, 0) },
+    { 300, 200, golden_level_tile(300, 200) },
+    { 511, 383, golden_level_tile(511, 383) },
+  };
+  for (const int* tile : tiles) {
+    if (mget(tile[0], tile[1]) != tile[2]) {
+      SDL_LogError(SDL_LOG_CATEGORY_APPLICATION, "Tile %d, %d of the saved level is %d, not %d",
+                   tile[0], tile[1], mget(tile[0], tile[1]), tile[2]);
+      return false;
+    }
+  }
+  return true;
+}
+
+static bool golden_pinned_select; // Frames pick the bank until it's there
+static BankCacheCounters golden_pinned_counters; // Once it was
+
+// A bank picked once and then drawn with frame after frame, while the even banks take turns in
+// the other layer of the cache
+static void golden_bank_pinned() {
+  cls(1);
+  palt();
+  pal();
+  if (golden_pinned_select) {
+    golden_pinned_select = !use_bank(GOLDEN_PINNED_BANK);
+  }
+  prefetch_bank(golden_frame % (GOLDEN_ARCHIVE_BANKS / 2) * 2);
+  for (int i = 0; i < 100; ++i) {
+    spr(golden_rnd(256), golden_rnd(144) - 8, golden_rnd(144) - 8);
+  }
+}
+
+static bool golden_prepare_bank_pinned(unsigned int fbo) {
+  if (!golden_open_archive()) {
+    return false;
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(golden_mutex);
+    golden_pinned_select = true;
+  }
+  bool selected = false;
+  for (int i = 0; i < GOLDEN_LOAD_FRAMES && !selected; ++i) {
+    golden_next_frame(fbo);
+    std::lock_guard<std::mutex> lock(golden_mutex);
+    selected = !golden_pinned_select;
+  }
+  if (!selected) {
+    SDL_LogError(SDL_LOG_CATEGORY_APPLICATION, "Archive bank %d never loaded",
+                 GOLDEN_PINNED_BANK);
+    return false;
+  }
+
+  golden_pinned_counters = bank_counters();
+  for (int i = 0; i < GOLDEN_PINNED_FRAMES; ++i) {
+    golden_next_frame(fbo);
+  }
+  return true;
+}
+
+// The other banks were evicted in turn, the picked one never was
+static bool golden_check_bank_pinned(int frames) {
+  unsigned int evictions = bank_counters().evictions - golden_pinned_counters.evictions;
+  bool kept = use_bank(GOLDEN_PINNED_BANK);
+  if (evictions < 2 || !kept) {
+    SDL_LogError(SDL_LOG_CATEGORY_APPLICATION,
+                 "The bank cache evicted %u banks, the picked one is %s", evictions,
+                 kept ? "still there" : "gone");
+  }
+  bank();
+  close_banks();
+  return evictions >= 2 && kept;
+}
+
+static const GoldenScene golden_scenes[] = {
+  { "sprites", golden_sprites },
+  { "sspr", golden_sspr },
+  { "palette", golden_palette },
+  { "states", golden_states },
+  { "primitives", golden_primitives },
+  { "text", golden_text },
+  { "edges", golden_edges },
+  { "map", golden_map },
+  { "banks", golden_banks },
+  { "bank_cache", golden_bank_cache, golden_prepare_bank_cache, golden_check_bank_cache },
+  { "level", golden_level, golden_prepare_level },
+  { "bank_pinned", golden_bank_pinned, golden_prepare_bank_pinned, golden_check_bank_pinned },
+};
+
+// The first path is the reference the others are compared to
+static const GoldenPath golden_paths[] = {
+  { "indexed", true, 0 },
+  { "direct", false, 0 },
+  { "pull", true, VOX_SPRITES_VERTEX_PULLING },
+  { "deferred", true, VOX_SPRITES_DEFERRED },
+  { "pull_deferred", true, VOX_SPRITES_VERTEX_PULLING | VOX_SPRITES_DEFERRED },
+  { "direct_deferred", false, VOX_SPRITES_DEFERRED },
+  { "threaded", true, 0, true },
+};
+
+void update() {}
+
+void draw() {
+  std::unique_lock<std::mutex> lock(golden_mutex);
+  if (golden_threaded) {
+    golden_allow.wait(lock, [] { return golden_allowed > 0; });
+    --golden_allowed;
+  }
+  rnd_seed(golden_frame + 1);
+  golden_scene->draw();
+  ++golden_frame;
+}
+
+// On the threaded path the worker is let through for exactly one frame, which is then drawn
+static void golden_next_frame(unsigned int fbo) {
+  if (!golden_threaded) {
+    frame(fbo);
+    return;
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(golden_mutex);
+    ++golden_allowed;
+  }
+  golden_allow.notify_one();
+  while (!frame(fbo)) {
+  }
+}
+
+static uint32_t golden_hash(const std::vector<uint8_t>& rgb) {
+  uint32_t hash = GOLDEN_FNV_OFFSET;
+  for (size_t i = 0; i < rgb.size(); ++i) {
+    hash = (hash ^ rgb[i]) * GOLDEN_FNV_PRIME;
+  }
+  return hash;
+}
+
+static bool golden_write_ppm(const std::string& filename, const std::vector<uint8_t>& rgb) {
+  FILE* f = fopen(filename.c_str(), "wb");
+  if (!f) {
+    SDL_LogError(SDL_LOG_CATEGORY_APPLICATION, "Unable to write %s", filename.c_str());
+    return false;
+  }
+  fprintf(f, "P6\n%d %d\n255\n", VOX_WIDTH, VOX_WIDTH);
+  bool written = fwrite(rgb.data(), 1, rgb.size(), f) == rgb.size();
+  fclose(f);
+  return written;
+}
+
+static bool golden_find(const std::vector<GoldenResult>& results, const char* scene,
+                        uint32_t* hash) {
+  for (size_t i = 0; i < results.size(); ++i) {
+    if (results[i].scene == scene) {
+      *hash = results[i].hash;
+      return true;
+    }
+  }
+  return false;
+}
+
+// Runs in the child process, one line per scene to out. Frames that don't match expected
+// are saved to dump.
+// Draws every scene on the path once it's set up, golden_run_path() cleans up after it
+static bool golden_run_scenes(Headless* headless, const GoldenPath* path, int frames,
+                              const std::vector<const GoldenScene*>& scenes,
+                              const std::vector<GoldenResult>& expected, const char* dump,
+                              FILE* out) {
+  if (!init(path->indexed, path->sprites_flags)) {
+    return false;
+  }
+  set_screen_rect({ 0, 0, VOX_WIDTH, VOX_WIDTH });
+  if (!load_bank(2, "pico8_font.png")) {
+    return false;
+  }
+  golden_threaded = path->threaded;
+  if (golden_threaded && !start_worker(GOLDEN_WORKER_RATE)) {
+    return false;
+  }
+
+  std::vector<uint8_t> rgb(VOX_WIDTH * VOX_WIDTH * 3);
+  for (size_t i = 0; i < scenes.size(); ++i) {
+    {
+      std::lock_guard<std::mutex> lock(golden_mutex);
+      golden_scene = scenes[i];
+      golden_frame = 0;
+    }
+    if (golden_scene->prepare) {
+      if (!golden_scene->prepare(headless->fbo)) {
+        return false;
+      }
+      std::lock_guard<std::mutex> lock(golden_mutex);
+      golden_frame = 0;
+    }
+
+    uint64_t start = SDL_GetPerformanceCounter();
+    for (int j = 0; j < frames; ++j) {
+      golden_next_frame(headless->fbo);
+    }
+    glFinish();
+    uint64_t ticks = SDL_GetPerformanceCounter() - start;
+    if (golden_scene->check && !golden_scene->check(frames)) {
+      return false;
+    }
+
+    headless_read_pixels(headless, rgb.data());
+    uint32_t hash = golden_hash(rgb);
+
+    uint32_t expected_hash;
+    if (golden_find(expected, golden_scene->name, &expected_hash) && hash != expected_hash) {
+      golden_write_ppm(std::string(dump) + "/" + golden_scene->name + "." + path->name + ".ppm",
+                       rgb);
+    }
+
+    fprintf(out, "%s %08x %f\n", golden_scene->name, hash,
+            1000.0 * ticks / SDL_GetPerformanceFrequency() / frames);
+  }
+  return true;
+}
+
+static int golden_run_path(const GoldenPath* path, int frames,
+                           const std::vector<const GoldenScene*>& scenes,
+                           const std::vector<GoldenResult>& expected, const char* dump,
+                           FILE* out) {
+  Headless headless;
+  if (!headless_init(&headless, VOX_WIDTH, VOX_WIDTH)) {
+    return 1;
+  }
+
+  bool ran = golden_run_scenes(&headless, path, frames, scenes, expected, dump, out);
+
+  // A scene that failed can leave the worker waiting for frames and the bank cache open
+  if (golden_threaded) {
+    {
+      std::lock_guard<std::mutex> lock(golden_mutex);
+      golden_allowed = INT_MAX;
+    }
+    golden_allow.notify_one();
+  }
+  stop_worker();
+  close_banks();
+  headless_destroy(&headless);
+  return ran ? 0 : 1;
+}
+
+// Forks a process for the path and collects its results
+static bool golden_spawn(const GoldenPath* path, int frames,
+                         const std::vector<const GoldenScene*>& scenes,
+                         const std::vector<GoldenResult>& expected, const char* dump,
+                         std::vector<GoldenResult>* results) {
+  int fds[2];
+  if (pipe(fds) != 0) {
+    SDL_LogError(SDL_LOG_CATEGORY_APPLICATION, "Unable to create a pipe");
+    return false;
+  }
+
+  fflush(stdout);
+  pid_t pid = fork();
+  if (pid < 0) {
+    SDL_LogError(SDL_LOG_CATEGORY_APPLICATION, "Unable to fork");
+    return false;
+  }
+
+  if (pid == 0) {
+    close(fds[0]);
+    FILE* out = fdopen(fds[1], "w");
+    int status = golden_run_path(path, frames, scenes, expected, dump, out);
+    fclose(out);
+    _exit(status);
+  }
+
+  close(fds[1]);
+  FILE* in = fdopen(fds[0], "r");
+  char scene[64];
+  unsigned int hash;
+  double ms;
+  while (fscanf(in, "%63s %x %lf", scene, &hash, &ms) == 3) {
+    GoldenResult result;
+    result.scene = scene;
+    result.hash = hash;
+    result.ms = ms;
+    results->push_back(result);
+  }
+  fclose(in);
+
+  int status;
+  waitpid(pid, &status, 0);
+  if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+    SDL_LogError(SDL_LOG_CATEGORY_APPLICATION, "Path %s failed to run", path->name);
+    return false;
+  }
+  return results->size() == scenes.size();
+}
+
+static std::vector<GoldenResult> golden_load(const char* filename) {
+  std::vector<GoldenResult> results;
+  FILE* f = fopen(filename, "r");
+  if (!f) {
+    return results;
+  }
+
+  char scene[64];
+  unsigned int hash;
+  while (fscanf(f, "%63s %x", scene, &hash) == 2) {
+    GoldenResult result;
+    result.scene = scene;
+    result.hash = hash;
+    result.ms = 0.0;
+    results.push_back(result);
+  }
+
+  fclose(f);
+  return results;
+}
+
+static bool golden_save(const char* filename, const std::vector<GoldenResult>& results) {
+  FILE* f = fopen(filename, "w");
+  if (!f) {
+    SDL_LogError(SDL_LOG_CATEGORY_APPLICATION, "Unable to write %s", filename);
+    return false;
+  }
+  for (size_t i = 0; i < results.size(); ++i) {
+    fprintf(f, "%s %08x\n", results[i].scene.c_str(), results[i].hash);
+  }
+  fclose(f);
+  return true;
+}
+
+// Every RGB color through quantize_image() has to come out as color_find_closest() has it.
+// Each row holds every blue value for a red and green and then GOLDEN_QUANTIZE_TAIL more, so
+// the SIMD loops also leave a tail. Returns the mismatches.
+static int golden_check_quantizer() {
+  const int width = 256 + GOLDEN_QUANTIZE_TAIL;
+  std::vector<uint8_t> rgba(width * 256 * 4);
+  std::vector<uint8_t> indices(width * 256);
+  int mismatches = 0;
+  for (int r = 0; r < 256; ++r) {
+    for (int g = 0; g < 256; ++g) {
+      for (int x = 0; x < width; ++x) {
+        uint8_t* p = &rgba[(g * width + x) * 4];
+        p[0] = r;
+        p[1] = g;
+        p[2] = (x + g * (x / 256)) & 255; // The tail gets other colors on every row
+        p[3] = 255;
+      }
+    }
+    quantize_image(rgba.data(), width * 4, width, 256, indices.data(), width);
+    for (int i = 0; i < width * 256; ++i) {
+      const uint8_t* p = &rgba[i * 4];
+      mismatches += indices[i] != color_find_closest(p[0], p[1], p[2]);
+    }
+  }
+  return mismatches;
+}
+
+int main(int argc, char* argv[]) {
+  int frames = GOLDEN_DEFAULT_FRAMES;
+  const char* golden = nullptr;
+  const char* dump = ".";
+  bool update_golden = false;
+  std::vector<const GoldenScene*> scenes;
+  std::vector<const GoldenPath*> paths;
+
+  for (int i = 1; i < argc; ++i) {
+    if (strcmp(argv[i], "--frames") == 0 && i + 1 < argc) {
+      frames = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--golden") == 0 && i + 1 < argc) {
+      golden = argv[++i];
+    } else if (strcmp(argv[i], "--update") == 0) {
+      update_golden = true;
+    } else if (strcmp(argv[i], "--dump") == 0 && i + 1 < argc) {
+      dump = argv[++i];
+    } else if (strcmp(argv[i], "--scene") == 0 && i + 1 < argc) {
+      const char* name = argv[++i];
+      for (const GoldenScene& s : golden_scenes) {
+        if (strcmp(s.name, name) == 0) scenes.push_back(&s);
+      }
+    } else if (strcmp(argv[i], "--path") == 0 && i + 1 < argc) {
+      const char* name = argv[++i];
+      for (const GoldenPath& p : golden_paths) {
+        if (strcmp(p.name, name) == 0) paths.push_back(&p);
+      }
+    }
+  }
+
+  if (frames <= 0) {
+    SDL_LogError(SDL_LOG_CATEGORY_APPLICATION, "--frames must be positive");
+    return 1;
+  }
+
+  if (scenes.empty()) {
+    for (const GoldenScene& s : golden_scenes) {
+      scenes.push_back(&s);
+    }
+  }
+
+  // The reference always runs so the others have something to match
+  paths.insert(paths.begin(), &golden_paths[0]);
+  if (paths.size() == 1) {
+    for (size_t i = 1; i < sizeof(golden_paths) / sizeof(golden_paths[0]); ++i) {
+      paths.push_back(&golden_paths[i]);
+    }
+  }
+
+  std::vector<GoldenResult> expected;
+  if (golden && !update_golden) {
+    expected = golden_load(golden);
+    if (expected.empty()) {
+      SDL_LogWarn(SDL_LOG_CATEGORY_APPLICATION,
+                  "No golden hashes in %s, comparing against the %s path only", golden,
+                  golden_paths[0].name);
+    }
+  }
+
+  // The quantizer doesn't depend on the path, it's checked once with the palette and once with
+  // a color moved so its table is built again
+  int failures = 0;
+  int mismatches = golden_check_quantizer();
+  Color saved = color_palette[5];
+  color_palette[5] = { 10, 200, 10 };
+  mismatches += golden_check_quantizer();
+  color_palette[5] = saved;
+  if (mismatches > 0) {
+    SDL_LogError(SDL_LOG_CATEGORY_APPLICATION,
+                 "quantize_image() and color_find_closest() disagree on %d colors", mismatches);
+    ++failures;
+  }
+
+  printf("%-12s %-16s %-8s %10s  %s\n", "scene", "path", "hash", "ms/frame", "result");
+
+  for (size_t i = 0; i < paths.size(); ++i) {
+    if (i > 0 && paths[i] == paths[0]) {
+      continue;
+    }
+
+    std::vector<GoldenResult> results;
+    if (!golden_spawn(paths[i], frames, scenes, expected, dump, &results)) {
+      ++failures;
+      continue;
+    }
+
+    for (size_t j = 0; j < results.size(); ++j) {
+      const GoldenResult& r = results[j];
+      uint32_t expected_hash;
+      const char* verdict = "new";
+      if (golden_find(expected, r.scene.c_str(), &expected_hash)) {
+        verdict = expected_hash == r.hash ? "ok" : "MISMATCH";
+        failures += expected_hash != r.hash;
+      }
+      printf("%-12s %-16s %08x %10.3f  %s\n", r.scene.c_str(), paths[i]->name, r.hash, r.ms,
+             verdict);
+    }
+
+    // Without golden hashes every scene the reference drew becomes the expectation
+    if (i == 0) {
+      for (size_t j = 0; j < results.size(); ++j) {
+        uint32_t hash;
+        if (!golden_find(expected, results[j].scene.c_str(), &hash)) {
+          expected.push_back(results[j]);
+        }
+      }
+      if (update_golden && golden && !golden_save(golden, results)) {
+        return 1;
+      }
+    }
+  }
+
+  printf("%d failure(s)\n", failures);
+  return failures > 0 ? 1 : 0;
+}
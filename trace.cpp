@@ -0,0 +1,159 @@
+#include "trace.h"
+
+#include <SDL_log.h>
+#include <SDL_timer.h>
+#include <atomic>
+#include <epoxy/gl.h>
+#include <mutex>
+#include <stdio.h>
+#include <string>
+#include <vector>
+
+struct TraceEvent {
+  const char* name;
+  uint64_t start;
+  uint64_t end;
+};
+
+struct TraceBuffer {
+  unsigned int tid;
+  std::string name;
+  std::atomic<unsigned int> count; // Events below count are complete
+  std::atomic<unsigned int> dropped;
+  TraceEvent events[VOX_TRACE_EVENTS];
+};
+
+static std::atomic<bool> trace_on;
+static bool trace_debug_groups;
+static uint64_t trace_origin;
+static std::mutex trace_mutex; // Only taken when a thread first records and when writing
+static std::vector<TraceBuffer*> trace_buffers;
+static thread_local TraceBuffer* trace_buffer = nullptr;
+static thread_local std::string trace_name; // Kept for the buffer until the thread records
+
+void trace_enable(bool enabled) {
+  if (enabled && trace_origin == 0) {
+    trace_origin = SDL_GetPerformanceCounter();
+    trace_debug_groups = epoxy_gl_version() >= 43 || epoxy_has_gl_extension("GL_KHR_debug");
+  }
+  trace_on.store(enabled, std::memory_order_release);
+}
+
+bool trace_enabled() { return trace_on.load(std::memory_order_acquire); }
+
+// Created by the first event a thread records with tracing on, then kept after the thread
+// exits so it still ends up in the output
+static TraceBuffer* trace_thread_buffer() {
+  if (!trace_buffer) {
+    TraceBuffer* buffer = new TraceBuffer();
+    buffer->count.store(0, std::memory_order_relaxed);
+    buffer->dropped.store(0, std::memory_order_relaxed);
+    buffer->name = trace_name;
+
+    std::lock_guard<std::mutex> lock(trace_mutex);
+    buffer->tid = trace_buffers.size() + 1;
+    trace_buffers.push_back(buffer);
+    trace_buffer = buffer;
+  }
+  return trace_buffer;
+}
+
+void trace_thread_name(const char* name) {
+  trace_name = name;
+  if (trace_buffer) {
+    std::lock_guard<std::mutex> lock(trace_mutex);
+    trace_buffer->name = name;
+  }
+}
+
+uint64_t trace_now() { return SDL_GetPerformanceCounter(); }
+
+void trace_event(const char* name, uint64_t start, uint64_t end) {
+  if (!trace_enabled()) {
+    return;
+  }
+
+  TraceBuffer* buffer = trace_thread_buffer();
+  unsigned int count = buffer->count.load(std::memory_order_relaxed);
+  if (count >= VOX_TRACE_EVENTS) {
+    buffer->dropped.fetch_add(1, std::memory_order_relaxed);
+    return;
+  }
+
+  TraceEvent* event = &buffer->events[count];
+  event->name = name;
+  event->start = start;
+  event->end = end;
+  buffer->count.store(count + 1, std::memory_order_release);
+}
+
+TraceScope::TraceScope(const char* name, bool gl) : name(nullptr), start(0), gl(false) {
+  if (trace_enabled()) {
+    this->name = name;
+    this->gl = gl && trace_debug_groups;
+    if (this->gl) {
+      glPushDebugGroup(GL_DEBUG_SOURCE_APPLICATION, 0, -1, name);
+    }
+    start = trace_now();
+  }
+}
+
+TraceScope::~TraceScope() {
+  if (name) {
+    trace_event(name, start, trace_now());
+    // Popped even if tracing was turned off in between so the groups stay balanced
+    if (gl) {
+      glPopDebugGroup();
+    }
+  }
+}
+
+static double trace_microseconds(uint64_t ticks) {
+  return 1e6 * static_cast<double>(ticks - trace_origin) / SDL_GetPerformanceFrequency();
+}
+
+bool trace_write(const char* filename) {
+  FILE* f = fopen(filename, "w");
+  if (!f) {
+    SDL_LogError(SDL_LOG_CATEGORY_APPLICATION, "Unable to write %s", filename);
+    return false;
+  }
+
+  std::lock_guard<std::mutex> lock(trace_mutex);
+
+  fprintf(f, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n");
+  fprintf(f, "{\"name\": \"process_name\", \"ph\": \"M\", \"pid\": 1, \"args\": {\"name\": "
+             "\"vox\"}}");
+
+  for (size_t i = 0; i < trace_buffers.size(); ++i) {
+    TraceBuffer* buffer = trace_buffers[i];
+    if (!buffer->name.empty()) {
+      fprintf(f,
+              ",\n{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": %u, "
+              "\"args\": {\"name\": \"%s\"}}",
+              buffer->tid, buffer->name.c_str());
+    }
+
+    unsigned int count = buffer->count.load(std::memory_order_acquire);
+    for (unsigned int j = 0; j < count; ++j) {
+      const TraceEvent& event = buffer->events[j];
+      double ts = trace_microseconds(event.start);
+      fprintf(f,
+              ",\n{\"name\": \"%s\", \"ph\": \"X\", \"pid\": 1, \"tid\": %u, \"ts\": %.3f, "
+              "\"dur\": %.3f}",
+              event.name, buffer->tid, ts, trace_microseconds(event.end) - ts);
+    }
+
+    unsigned int dropped = buffer->dropped.load(std::memory_order_relaxed);
+    if (dropped > 0) {
+      SDL_LogWarn(SDL_LOG_CATEGORY_APPLICATION, "Trace dropped %u events of thread %u", dropped,
+                  buffer->tid);
+    }
+  }
+
+  fprintf(f, "\n]}\n");
+  bool written = !ferror(f);
+  fclose(f);
+
+  return written;
+}
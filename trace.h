@@ -0,0 +1,36 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+
+#define VOX_TRACE_EVENTS 65536 // Per thread, later events are dropped
+
+// Timeline markers written as Chrome trace events, which Perfetto and chrome://tracing open.
+// Every thread records into its own buffer without locking, trace_write() can be called from
+// any thread at any time and writes what has been recorded so far.
+void trace_enable(bool enabled); // Call with a GL context current to also get debug groups
+bool trace_enabled();
+// Names the calling thread in the output, its buffer is only allocated once it records
+void trace_thread_name(const char* name);
+bool trace_write(const char* filename);
+
+uint64_t trace_now();
+void trace_event(const char* name, uint64_t start, uint64_t end); // name must outlive the trace
+
+// Records from construction to destruction, gl also wraps it in a KHR_debug group so the GL
+// work shows up under the same name in GPU debuggers
+struct TraceScope {
+  const char* name;
+  uint64_t start;
+  bool gl;
+
+  TraceScope(const char* name, bool gl = false);
+  ~TraceScope();
+};
+
+#define TRACE_CONCAT2(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT2(a, b)
+#define TRACE(name) TraceScope TRACE_CONCAT(trace_scope_, __LINE__)(name)
+#define TRACE_GL(name) TraceScope TRACE_CONCAT(trace_scope_, __LINE__)(name, true)
+
+#endif // TRACE_H
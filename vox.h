@@ -11,6 +11,11 @@
 #define VOX_SPRITE_WIDTH 8
 #define VOX_SPRITES_WIDTH (VOX_SPRITES_COUNT * VOX_SPRITE_WIDTH)
 
+// Sprite sheets are layers of one array texture so a batch can mix all of them
+#define VOX_SPRITE_BANKS 16
+#define VOX_BANK_FONT 0
+#define VOX_BANK_GAME 1 // The sheet spr() and map() use until bank() picks another
+
 #define VOX_ERROR static_cast<unsigned int>(-1)
 
 #endif // VOX_H